@@ -0,0 +1,158 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <direct.h>
+#include <io.h>
+#include <sys/locking.h>
+#else
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "ccache.h"
+#include "cgen.h"
+
+namespace clib {
+
+    ccache::ccache(const string_t &dir) : dir(dir) {
+#ifdef _MSC_VER
+        _mkdir(dir.c_str());
+#else
+        mkdir(dir.c_str(), 0755); // 已存在时失败，忽略
+#endif
+    }
+
+    // FNV-1a 64位
+    static uint64_t hash_bytes(uint64_t h, const char *p, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            h ^= (byte) p[i];
+            h *= 0x100000001b3ULL;
+        }
+        return h;
+    }
+
+    string_t ccache::path(const string_t &source) const {
+        char version[32];
+        snprintf(version, sizeof(version), "%d.%d", CGEN_VERSION, IMAGE_VERSION);
+        auto h = hash_bytes(0xcbf29ce484222325ULL, version, strlen(version));
+        // 调用号依赖注册顺序，注册了不同系统调用的进程使用各自的缓存
+        auto n = cvm::syscall_count();
+        for (auto i = 0; i < n; i++) {
+            auto sys = cvm::get_syscall(i);
+            h = hash_bytes(h, sys->name.c_str(), sys->name.size() + 1);
+            h = hash_bytes(h, (const char *) &sys->arity, sizeof(sys->arity));
+        }
+        h = hash_bytes(h, source.data(), source.size());
+        char name[64];
+        snprintf(name, sizeof(name), "/%016llx-%zx.cmi", (unsigned long long) h, source.size());
+        return dir + name;
+    }
+
+    std::unique_ptr<cimage> ccache::get(const string_t &source) const {
+        auto file = path(source);
+        if (cimage::is_image(file.c_str())) {
+            try {
+                auto img = cimage::load(file.c_str());
+                count("hits");
+                return img;
+            } catch (const std::exception &) {
+                // 损坏的镜像当作未命中，重新编译后覆盖
+            }
+        }
+        count("misses");
+        return nullptr;
+    }
+
+    bool ccache::put(const string_t &source, const cimage &image) const {
+        return image.save(path(source).c_str());
+    }
+
+    ulong ccache::hits() const {
+        return counter("hits");
+    }
+
+    ulong ccache::misses() const {
+        return counter("misses");
+    }
+
+    // 计数文件为8字节的计数，加锁后读出、加一、写回，多进程并发计数不会丢失；新建的空文件为0
+#ifdef _MSC_VER
+    static bool counter_lock(int fd, bool) {
+        _lseek(fd, 0, SEEK_SET);
+        return _locking(fd, LK_LOCK, 1) == 0; // 锁住第一个字节
+    }
+
+    static void counter_unlock(int fd) {
+        _lseek(fd, 0, SEEK_SET);
+        _locking(fd, LK_UNLCK, 1);
+    }
+
+    static uint64_t counter_read(int fd) {
+        uint64_t n = 0;
+        _lseek(fd, 0, SEEK_SET);
+        if (_read(fd, &n, sizeof(n)) != sizeof(n))
+            n = 0;
+        return n;
+    }
+
+    static void counter_write(int fd, uint64_t n) {
+        _lseek(fd, 0, SEEK_SET);
+        _write(fd, &n, sizeof(n));
+    }
+#else
+    static bool counter_lock(int fd, bool exclusive) {
+        return flock(fd, exclusive ? LOCK_EX : LOCK_SH) == 0;
+    }
+
+    static void counter_unlock(int fd) {
+        flock(fd, LOCK_UN);
+    }
+
+    static uint64_t counter_read(int fd) {
+        uint64_t n = 0;
+        if (pread(fd, &n, sizeof(n), 0) != sizeof(n))
+            n = 0;
+        return n;
+    }
+
+    static void counter_write(int fd, uint64_t n) {
+        pwrite(fd, &n, sizeof(n), 0);
+    }
+#define _open open
+#define _close close
+#define _O_RDWR O_RDWR
+#define _O_RDONLY O_RDONLY
+#define _O_CREAT O_CREAT
+#define _O_BINARY 0
+#endif
+
+    void ccache::count(const char *name) const {
+        auto fd = _open((dir + "/" + name).c_str(), _O_RDWR | _O_CREAT | _O_BINARY, 0644);
+        if (fd < 0)
+            return;
+        if (counter_lock(fd, true)) {
+            counter_write(fd, counter_read(fd) + 1);
+            counter_unlock(fd);
+        }
+        _close(fd);
+    }
+
+    ulong ccache::counter(const char *name) const {
+        auto fd = _open((dir + "/" + name).c_str(), _O_RDONLY | _O_BINARY);
+        if (fd < 0)
+            return 0;
+        uint64_t n = 0;
+        if (counter_lock(fd, false)) {
+            n = counter_read(fd);
+            counter_unlock(fd);
+        }
+        _close(fd);
+        return (ulong) n;
+    }
+}
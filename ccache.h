@@ -0,0 +1,43 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#ifndef CMINILANG_CACHE_H
+#define CMINILANG_CACHE_H
+
+#include <memory>
+#include "types.h"
+#include "cimage.h"
+
+namespace clib {
+
+    // 编译缓存：以源码和编译器版本的哈希为键，在缓存目录中保存镜像
+    // 不保存状态，可在多个线程、多个进程中同时使用
+    class ccache {
+    public:
+        explicit ccache(const string_t &dir);
+        ~ccache() = default;
+
+        // 未命中时返回空
+        std::unique_ptr<cimage> get(const string_t &source) const;
+        // 写入临时文件后改名，不会读到写了一半的镜像
+        bool put(const string_t &source, const cimage &image) const;
+
+        // 命中、未命中次数，所有使用该目录的进程累计
+        ulong hits() const;
+        ulong misses() const;
+
+        // 源码对应的镜像文件
+        string_t path(const string_t &source) const;
+
+    private:
+        void count(const char *name) const;
+        ulong counter(const char *name) const;
+
+    private:
+        string_t dir;
+    };
+}
+
+#endif //CMINILANG_CACHE_H
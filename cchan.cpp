@@ -0,0 +1,31 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#include "cchan.h"
+
+namespace clib {
+
+    cchan::cchan(uint32_t size) : cells(new cell_t[size]), mask(size - 1) {
+        for (uint32_t i = 0; i < size; ++i) {
+            cells[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    void cchan::close() {
+        closed = true;
+    }
+
+    bool cchan::is_closed() const {
+        return closed;
+    }
+
+    cchan *cchan_set::get(int id) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto &chan = chans[id];
+        if (!chan)
+            chan.reset(new cchan());
+        return chan.get();
+    }
+}
@@ -0,0 +1,126 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#ifndef CMINILANG_CHAN_H
+#define CMINILANG_CHAN_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "types.h"
+
+/* 通道容量（消息数，2的幂） */
+#define CHAN_SIZE 1024
+
+namespace clib {
+
+    // 有界无锁多生产者多消费者队列（Vyukov），用于虚拟机之间传递消息
+    // 消息直接拷入/拷出槽内缓冲，不经过中间缓冲
+    class cchan {
+    public:
+        explicit cchan(uint32_t size = CHAN_SIZE);
+        ~cchan() = default;
+
+        // 队列满时返回false，fill(byte *dst)负责填充len字节，抛出异常时消息作废，接收方跳过
+        template<class F>
+        bool try_send(uint32_t len, F fill);
+        // 队列空时返回false，drain(const byte *src, uint32_t len)负责取出，抛出异常时消息被丢弃
+        template<class F>
+        bool try_recv(F drain);
+
+        void close();
+        bool is_closed() const;
+
+    private:
+        struct cell_t {
+            std::atomic<uint32_t> seq;
+            std::vector<byte> msg;
+            bool dropped{false}; // 发送失败，槽已发布但没有消息
+        };
+
+        std::unique_ptr<cell_t[]> cells;
+        uint32_t mask;
+        alignas(64) std::atomic<uint32_t> head{0}; // 发送位置
+        alignas(64) std::atomic<uint32_t> tail{0}; // 接收位置
+        std::atomic<bool> closed{false};
+    };
+
+    // 通道表，按编号取得通道，不存在则创建
+    // 每个虚拟机默认有自己的通道表，fork的子虚拟机与父虚拟机共用，互相通信的虚拟机须设置为同一个
+    class cchan_set {
+    public:
+        cchan *get(int id);
+
+    private:
+        std::mutex lock;
+        std::map<int, std::unique_ptr<cchan>> chans;
+    };
+
+    template<class F>
+    bool cchan::try_send(uint32_t len, F fill) {
+        auto pos = head.load(std::memory_order_relaxed);
+        cell_t *cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            auto seq = cell->seq.load(std::memory_order_acquire);
+            auto diff = (int) (seq - pos);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false; // 满
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        try {
+            cell->msg.resize(len); // 槽内缓冲复用容量
+            fill(cell->msg.data());
+        } catch (...) {
+            cell->msg.clear();
+            cell->dropped = true;
+            cell->seq.store(pos + 1, std::memory_order_release); // 仍要发布，否则接收方停在此处
+            throw;
+        }
+        cell->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    template<class F>
+    bool cchan::try_recv(F drain) {
+        auto pos = tail.load(std::memory_order_relaxed);
+        cell_t *cell;
+        while (true) {
+            cell = &cells[pos & mask];
+            auto seq = cell->seq.load(std::memory_order_acquire);
+            auto diff = (int) (seq - (pos + 1));
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    if (!cell->dropped)
+                        break;
+                    cell->dropped = false; // 跳过作废的消息
+                    cell->seq.store(pos + mask + 1, std::memory_order_release);
+                    pos = tail.load(std::memory_order_relaxed);
+                }
+            } else if (diff < 0) {
+                return false; // 空
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        try {
+            drain(cell->msg.data(), (uint32_t) cell->msg.size());
+        } catch (...) {
+            cell->seq.store(pos + mask + 1, std::memory_order_release); // 丢弃消息，释放槽，否则队列不再前进
+            throw;
+        }
+        cell->seq.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+}
+
+#endif //CMINILANG_CHAN_H
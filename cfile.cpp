@@ -0,0 +1,137 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#include <sys/stat.h>
+#ifndef _MSC_VER
+#include <unistd.h>
+#else
+#define fstat _fstat
+#define stat _stat
+#define fileno _fileno
+#define S_ISREG(m) (((m) & _S_IFMT) == _S_IFREG)
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#endif
+#include "cfile.h"
+
+namespace clib {
+
+    cfile::cfile(FILE *f, bool owned) : f(f), owned(owned) {
+        struct stat st;
+        blocking = fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode); // 普通文件的读写总会结束
+        if (owned) {
+            buf.resize(FILE_BUFFER);
+            setvbuf(f, buf.data(), _IOFBF, buf.size());
+        }
+    }
+
+    cfile::~cfile() {
+        if (owned)
+            fclose(f);
+        else
+            fflush(f);
+    }
+
+    static bool file_exists(const char *path) {
+        auto f = fopen(path, "rb");
+        if (!f)
+            return false;
+        fclose(f);
+        return true;
+    }
+
+    std::shared_ptr<cfile> cfile::open(const char *path, int flags) {
+        auto rw = (flags & 3) == FILE_RDWR;
+        FILE *f;
+        if ((flags & 3) == FILE_RDONLY) {
+            f = fopen(path, "rb");
+        } else if (flags & (FILE_TRUNC | FILE_APPEND)) {
+            // fopen总会创建文件，没有FILE_CREAT时先确认文件存在
+            if (!(flags & FILE_CREAT) && !file_exists(path))
+                return nullptr;
+            if (flags & FILE_TRUNC)
+                f = fopen(path, rw ? "w+b" : "wb");
+            else
+                f = fopen(path, rw ? "a+b" : "ab");
+        } else {
+            // 不截断时从头改写
+            f = fopen(path, "r+b");
+            if (!f && (flags & FILE_CREAT))
+                f = fopen(path, "w+b");
+        }
+        if (!f)
+            return nullptr;
+        return std::shared_ptr<cfile>(new cfile(f, true));
+    }
+
+    std::shared_ptr<cfile> cfile::wrap(FILE *f) {
+        return std::shared_ptr<cfile>(new cfile(f, false));
+    }
+
+    int cfile::read(void *dst, uint32_t n) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (last == io_write)
+            fseek(f, 0, SEEK_CUR); // 读写切换前须定位
+        last = io_read;
+        auto got = fread(dst, 1, n, f);
+        if (got < n && ferror(f)) {
+            clearerr(f);
+            if (got == 0)
+                return -1;
+        }
+        return (int) got;
+    }
+
+    int cfile::write(const void *src, uint32_t n) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (last == io_read)
+            fseek(f, 0, SEEK_CUR);
+        last = io_write;
+        auto put = fwrite(src, 1, n, f);
+        if (put < n && ferror(f)) {
+            clearerr(f);
+            if (put == 0)
+                return -1;
+        }
+        return (int) put;
+    }
+
+    int cfile::pread(void *dst, uint32_t n, int64_t offset) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (last == io_write)
+            fflush(f); // 先写出缓冲区，才能读到
+        if (offset < 0)
+            return -1;
+#ifdef _MSC_VER
+        auto pos = ftello(f);
+        if (pos < 0 || fseeko(f, offset, SEEK_SET) != 0)
+            return -1;
+        auto got = fread(dst, 1, n, f);
+        fseeko(f, pos, SEEK_SET);
+        last = io_none;
+        return got > 0 || !ferror(f) ? (int) got : -1;
+#else
+        // 不经过流的缓冲区，也不改变流的位置
+        uint32_t total = 0;
+        while (total < n) {
+            auto got = ::pread(fileno(f), (char *) dst + total, n - total, (off_t) offset + total);
+            if (got < 0)
+                return total > 0 ? (int) total : -1;
+            if (got == 0)
+                break;
+            total += (uint32_t) got;
+        }
+        return (int) total;
+#endif
+    }
+
+    int64_t cfile::seek(int64_t offset, int whence) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (fseeko(f, offset, whence) != 0) // 须定义_FILE_OFFSET_BITS=64，off_t才是64位
+            return -1;
+        last = io_none;
+        return (int64_t) ftello(f);
+    }
+}
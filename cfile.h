@@ -0,0 +1,64 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#ifndef CMINILANG_FILE_H
+#define CMINILANG_FILE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "types.h"
+
+/* open的标志，取值与Linux的O_*相同 */
+#define FILE_RDONLY 0
+#define FILE_WRONLY 1
+#define FILE_RDWR   2
+#define FILE_CREAT  0x40
+#define FILE_TRUNC  0x200
+#define FILE_APPEND 0x400
+/* 文件读写缓冲区大小 */
+#define FILE_BUFFER (64 * 1024)
+
+namespace clib {
+
+    // 宿主文件，虚拟机中以句柄表的下标表示
+    // 读写共用一个缓冲区，读写切换时自动定位
+    class cfile {
+    public:
+        ~cfile();
+        cfile(const cfile &) = delete;
+        cfile &operator=(const cfile &) = delete;
+
+        // 按标志打开文件，失败时返回空
+        static std::shared_ptr<cfile> open(const char *path, int flags);
+        // 包装标准流，不关闭
+        static std::shared_ptr<cfile> wrap(FILE *f);
+
+        // 从当前位置读入至多n字节，返回读入字节数，出错返回-1
+        int read(void *dst, uint32_t n);
+        // 写入n字节，返回写入字节数，出错返回-1
+        int write(const void *src, uint32_t n);
+        // 从offset处读入，不改变当前位置
+        int pread(void *dst, uint32_t n, int64_t offset);
+        // 定位，返回新位置，出错返回-1；位置为64位，可超过2GB
+        int64_t seek(int64_t offset, int whence);
+        // 是否为管道、终端等读写可能一直阻塞的文件
+        bool may_block() const { return blocking; }
+
+    private:
+        cfile(FILE *f, bool owned);
+
+        FILE *f;
+        bool owned;
+        bool blocking{false};
+        enum { io_none, io_read, io_write } last{io_none};
+        std::vector<char> buf;
+        std::mutex lock;
+    };
+}
+
+#endif //CMINILANG_FILE_H
@@ -21,10 +21,11 @@ namespace clib {
             "Global",
             "Param",
             "Local",
+            "Syscall",
     };
 
     const string_t &class_str(class_t type) {
-        assert(type >= clz_not_found && type <= clz_var_local);
+        assert(type >= clz_not_found && type <= clz_syscall);
         return class_string_list[type];
     }
 
@@ -241,35 +242,45 @@ namespace clib {
         }
     }
 
-    void cgen::eval() {
+    void cgen::eval(int argc, char **argv) {
+        auto img = image();
+        cvm vm(img->code, img->data);
+        vm.init(img->entry, argc, argv);
+        vm.exec();
+    }
+
+    std::unique_ptr<cimage> cgen::image() const {
         auto entry = symbols[0].find("main");
         if (entry == symbols[0].end()) {
             printf("main() not defined\n");
             throw std::exception();
         }
-        cvm vm(text, data);
-        vm.exec(entry->second.data);
+        std::vector<cimage_sym> syms;
+        for (auto &sym : symbols[0]) {
+            syms.push_back({sym.first, sym.second.clazz, sym.second.data});
+        }
+        std::vector<cimage_syscall> calls;
+        for (auto id : syscalls) {
+            auto sys = cvm::get_syscall(id);
+            calls.push_back({sys->name, id, sys->arity});
+        }
+        return std::unique_ptr<cimage>(new cimage(std::make_shared<cvm_code>(text), data, entry->second.data,
+                                                  std::move(syms), std::move(calls)));
     }
 
     void cgen::builtin() {
         symbols.emplace_back(); // global context
-        builtin_add("printf", PRTF);
-        builtin_add("memcmp", MCMP);
-        builtin_add("exit", EXIT);
-        builtin_add("memset", MSET);
-        builtin_add("open", OPEN);
-        builtin_add("read", READ);
-        builtin_add("close", CLOS);
-        builtin_add("malloc", MALC);
-        builtin_add("trace", TRAC);
-        builtin_add("trans", TRAN);
+        builtin_add("exit", clz_builtin, EXIT);
+        for (auto i = 0; i < cvm::syscall_count(); ++i) { // 内建函数和宿主注册的函数均为系统调用
+            builtin_add(cvm::get_syscall(i)->name, clz_syscall, i);
+        }
     }
 
-    void cgen::builtin_add(const LEX_T(string) &name, ins_t ins) {
+    void cgen::builtin_add(const LEX_T(string) &name, class_t clazz, int value) {
         sym_t sym{
                 .node = nullptr,
-                .clazz = clz_builtin,
-                .data = ins
+                .clazz = clazz,
+                .data = value
         };
         builtins.insert(std::make_pair(name, sym));
     }
@@ -315,16 +326,17 @@ namespace clib {
     }
 
     sym_t cgen::find_symbol(const string_t &str) {
-        auto f = builtins.find(str);
-        if (f != builtins.end()) {
-            return f->second;
-        }
+        // 脚本定义的函数和变量覆盖同名的系统调用
         for (auto i = symbols.rbegin(); i != symbols.rend(); i++) {
-            f = i->find(str);
+            auto f = i->find(str);
             if (f != i->end()) {
                 return f->second;
             }
         }
+        auto f = builtins.find(str);
+        if (f != builtins.end()) {
+            return f->second;
+        }
         return sym_t{
                 .node = nullptr,
                 .clazz = clz_not_found,
@@ -333,7 +345,8 @@ namespace clib {
     }
 
     bool cgen::conflict_symbol(const string_t &str) {
-        if (builtins.find(str) != builtins.end()) {
+        auto b = builtins.find(str);
+        if (b != builtins.end() && b->second.clazz != clz_syscall) {
             return true;
         }
         if (symbols.back().find(str) != symbols.back().end()) {
@@ -785,6 +798,16 @@ namespace clib {
                 } else if (sym.clazz == clz_builtin) { // 内建函数
                     ast_recursion(node->child, rec); // param
                     emit((ins_t) sym.data); // builtin-inst
+                } else if (sym.clazz == clz_syscall) { // 系统调用
+                    auto arity = cvm::get_syscall(sym.data)->arity;
+                    auto argc = cast::children_size(node);
+                    if (arity >= 0 && arity != argc) {
+                        printf("wrong number of arguments: \"%s\" expects %d\n", node->data._string, arity);
+                        throw std::exception();
+                    }
+                    ast_recursion(node->child, rec); // param
+                    emit(SYSC, SYSC_OPERAND(sym.data, argc)); // SYSC id|argc
+                    syscalls.insert(sym.data);
                 } else { // 非法
                     expect(expect_valid_id, node);
                 }
@@ -815,6 +838,11 @@ namespace clib {
                                 CLASS_STRING(sym.clazz).c_str(), sym.data);
 #endif
                         break;
+                    case clz_func: // 函数地址
+                        emit(IMM, sym.data);
+                        expr_level = 4;
+                        ptr_level = 0;
+                        break;
                     case clz_var_global:
                         emit(IMM, sym.data);
                         emit(LOAD); // 载入data段数据
@@ -8,10 +8,20 @@
 
 #include <map>
 #include <memory>
+#include <set>
 #include <vector>
 #include "types.h"
 #include "memory.h"
 #include "cast.h"
+#include "cimage.h"
+
+/* 代码生成版本，生成的指令变化时递增，使编译缓存失效 */
+#define CGEN_VERSION 7
+
+/* SYSC的操作数：低16位为调用号，高16位为参数个数 */
+#define SYSC_OPERAND(id, argc) ((id) | ((argc) << 16))
+#define SYSC_ID(x) ((x) & 0xffff)
+#define SYSC_ARGC(x) ((int) ((uint32_t) (x) >> 16))
 
 namespace clib {
 
@@ -20,7 +30,7 @@ namespace clib {
     enum ins_t {
         NOP, LEA, IMM, IMX, JMP, CALL, JZ, JNZ, ENT, ADJ, LEV, LI, SI, LC, SC, PUSH, LOAD,
         OR, XOR, AND, EQ, NE, LT, GT, LE, GE, SHL, SHR, ADD, SUB, MUL, DIV, MOD,
-        OPEN, READ, CLOS, PRTF, MALC, MSET, MCMP, TRAC, TRAN, EXIT
+        SYSC, EXIT
     };
 
     enum class_t {
@@ -32,6 +42,7 @@ namespace clib {
         clz_var_global,
         clz_var_param,
         clz_var_local,
+        clz_syscall,
     };
 
     extern string_t class_string_list[];
@@ -56,7 +67,9 @@ namespace clib {
         explicit cgen(ast_node *node);
         ~cgen() = default;
 
-        void eval();
+        void eval(int argc, char **argv);
+        // 编译结果，未定义main时抛出异常
+        std::unique_ptr<cimage> image() const;
 
     private:
         void gen();
@@ -85,7 +98,7 @@ namespace clib {
 
     private:
         void builtin();
-        void builtin_add(const LEX_T(string) &name, ins_t value);
+        void builtin_add(const LEX_T(string) &name, class_t clazz, int value);
 
     private:
         ast_node *root;
@@ -97,6 +110,7 @@ namespace clib {
         std::vector<LEX_T(char)> data; // 数据
         std::vector<std::unordered_map<LEX_T(string), sym_t>> symbols;
         std::unordered_map<LEX_T(string), sym_t> builtins;
+        std::set<int> syscalls; // 用到的系统调用号，存入镜像供载入时校验
     };
 }
 
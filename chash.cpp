@@ -0,0 +1,169 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#include <cstring>
+#include "chash.h"
+
+namespace clib {
+
+    chash::chash(bool strkey) : strkey(strkey), mask(HASH_INIT - 1),
+                                hashes(HASH_INIT), keys(HASH_INIT), vals(HASH_INIT) {
+        if (strkey)
+            names.resize(HASH_INIT);
+    }
+
+    uint32_t chash::hash(int key) {
+        auto h = (uint32_t) key; // murmur3的末尾混合
+        h ^= h >> 16;
+        h *= 0x85ebca6b;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35;
+        h ^= h >> 16;
+        return h < 2 ? h + 2 : h;
+    }
+
+    uint32_t chash::hash(const char *key, uint32_t len) {
+        uint32_t h = 2166136261u; // FNV-1a
+        for (uint32_t i = 0; i < len; i++) {
+            h ^= (byte) key[i];
+            h *= 16777619u;
+        }
+        return h < 2 ? h + 2 : h;
+    }
+
+    template<class Eq>
+    int chash::probe(uint32_t h, Eq eq, int *insert) const {
+        auto i = h & mask;
+        auto tomb = -1;
+        while (true) {
+            auto cur = hashes[i];
+            if (cur == 0) {
+                if (insert)
+                    *insert = tomb >= 0 ? tomb : (int) i;
+                return -1;
+            }
+            if (cur == h && eq(i))
+                return (int) i;
+            if (cur == 1 && tomb < 0)
+                tomb = (int) i;
+            i = (i + 1) & mask;
+        }
+    }
+
+    void chash::reserve() {
+        auto capacity = mask + 1;
+        if ((used + 1) * 4 <= capacity * 3)
+            return;
+        rehash((count + 1) * 2 > capacity ? capacity * 2 : capacity);
+    }
+
+    void chash::rehash(uint32_t capacity) {
+        std::vector<uint32_t> old_hashes(capacity);
+        std::vector<int> old_keys(capacity), old_vals(capacity);
+        std::vector<std::string> old_names(strkey ? capacity : 0);
+        old_hashes.swap(hashes);
+        old_keys.swap(keys);
+        old_vals.swap(vals);
+        old_names.swap(names);
+        mask = capacity - 1;
+        used = count;
+        for (uint32_t j = 0; j < old_hashes.size(); j++) {
+            auto h = old_hashes[j];
+            if (h < 2)
+                continue;
+            auto i = h & mask;
+            while (hashes[i] != 0)
+                i = (i + 1) & mask;
+            hashes[i] = h;
+            keys[i] = old_keys[j];
+            vals[i] = old_vals[j];
+            if (strkey)
+                names[i].swap(old_names[j]);
+        }
+    }
+
+    bool chash::get(int key, int *val) const {
+        auto i = probe(hash(key), [&](uint32_t i) { return keys[i] == key; }, nullptr);
+        if (i < 0)
+            return false;
+        *val = vals[i];
+        return true;
+    }
+
+    bool chash::get(const char *key, uint32_t len, int *val) const {
+        auto i = probe(hash(key, len), [&](uint32_t i) {
+            return names[i].size() == len && memcmp(names[i].data(), key, len) == 0;
+        }, nullptr);
+        if (i < 0)
+            return false;
+        *val = vals[i];
+        return true;
+    }
+
+    bool chash::put(int key, int val) {
+        auto h = hash(key);
+        auto eq = [&](uint32_t i) { return keys[i] == key; };
+        int slot;
+        auto i = probe(h, eq, &slot);
+        if (i >= 0) {
+            vals[i] = val;
+            return false;
+        }
+        if (hashes[slot] == 0) {
+            reserve();
+            probe(h, eq, &slot);
+            used++;
+        }
+        hashes[slot] = h;
+        keys[slot] = key;
+        vals[slot] = val;
+        count++;
+        return true;
+    }
+
+    bool chash::put(const char *key, uint32_t len, int val) {
+        auto h = hash(key, len);
+        auto eq = [&](uint32_t i) {
+            return names[i].size() == len && memcmp(names[i].data(), key, len) == 0;
+        };
+        int slot;
+        auto i = probe(h, eq, &slot);
+        if (i >= 0) {
+            vals[i] = val;
+            return false;
+        }
+        if (hashes[slot] == 0) {
+            reserve();
+            probe(h, eq, &slot);
+            used++;
+        }
+        hashes[slot] = h;
+        names[slot].assign(key, len);
+        vals[slot] = val;
+        count++;
+        return true;
+    }
+
+    bool chash::del(int key) {
+        auto i = probe(hash(key), [&](uint32_t i) { return keys[i] == key; }, nullptr);
+        if (i < 0)
+            return false;
+        hashes[i] = 1;
+        count--;
+        return true;
+    }
+
+    bool chash::del(const char *key, uint32_t len) {
+        auto i = probe(hash(key, len), [&](uint32_t i) {
+            return names[i].size() == len && memcmp(names[i].data(), key, len) == 0;
+        }, nullptr);
+        if (i < 0)
+            return false;
+        hashes[i] = 1;
+        names[i].clear();
+        count--;
+        return true;
+    }
+}
@@ -0,0 +1,62 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#ifndef CMINILANG_HASH_H
+#define CMINILANG_HASH_H
+
+#include <string>
+#include <vector>
+#include "types.h"
+
+/* 散列表初始容量（2的幂） */
+#define HASH_INIT 16
+/* 每个虚拟机的散列表、动态数组数上限 */
+#define COLL_MAX 4096
+
+namespace clib {
+
+    // 开放定址（线性探测）散列表，键为整数或字符串，值为整数
+    // 散列值、键、值分别存放（SoA），探测时只读取散列值数组，命中后再比较键
+    class chash {
+    public:
+        explicit chash(bool strkey);
+
+        bool is_strkey() const { return strkey; }
+        uint32_t size() const { return count; }
+
+        // 查找键，找到时写入val并返回true
+        bool get(int key, int *val) const;
+        bool get(const char *key, uint32_t len, int *val) const;
+        // 插入或更新，新插入时返回true
+        bool put(int key, int val);
+        bool put(const char *key, uint32_t len, int val);
+        // 删除，存在时返回true
+        bool del(int key);
+        bool del(const char *key, uint32_t len);
+
+    private:
+        // 散列值0为空槽，1为已删除，有效值至少为2
+        static uint32_t hash(int key);
+        static uint32_t hash(const char *key, uint32_t len);
+
+        // 返回键所在的槽，没有时返回-1；insert非空时写入可插入的槽
+        template<class Eq>
+        int probe(uint32_t h, Eq eq, int *insert) const;
+        // 插入新键前保证装载率不超过3/4，已删除的槽较多时原容量重建
+        void reserve();
+        void rehash(uint32_t capacity);
+
+        bool strkey;
+        uint32_t mask;
+        uint32_t count{0}; // 有效的键
+        uint32_t used{0};  // 有效及已删除的槽
+        std::vector<uint32_t> hashes;
+        std::vector<int> keys;
+        std::vector<std::string> names; // 字符串键，仅strkey时使用
+        std::vector<int> vals;
+    };
+}
+
+#endif //CMINILANG_HASH_H
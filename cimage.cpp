@@ -0,0 +1,184 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#ifdef _MSC_VER
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#include "cimage.h"
+
+#define IMAGE_MAGIC "CMIM"
+
+namespace clib {
+
+    // 镜像文件头
+    struct cimage_header {
+        char magic[4];
+        uint32_t version;
+        int entry;
+        uint32_t symbols; // 符号数
+        uint32_t syscalls; // 系统调用数
+        uint32_t strings; // 字符串表长度
+        uint32_t data;    // 数据段长度
+        uint32_t text;    // 代码段偏移，按页对齐
+        uint32_t pages;   // 代码页数
+    };
+
+    // 文件中的符号
+    struct cimage_file_sym {
+        uint32_t name; // 在字符串表中的偏移
+        int clazz;
+        int data;
+    };
+
+    // 文件中的系统调用
+    struct cimage_file_syscall {
+        uint32_t name; // 在字符串表中的偏移
+        int id;
+        int arity;
+    };
+
+    cimage::cimage(std::shared_ptr<const cvm_code> code, std::vector<LEX_T(char)> data, int entry,
+                   std::vector<cimage_sym> symbols, std::vector<cimage_syscall> syscalls)
+            : code(code), data(std::move(data)), entry(entry), symbols(std::move(symbols)),
+              syscalls(std::move(syscalls)) {
+    }
+
+    bool cimage::is_image(const char *path) {
+        char magic[4];
+        auto f = fopen(path, "rb");
+        if (!f)
+            return false;
+        auto ok = fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, IMAGE_MAGIC, sizeof(magic)) == 0;
+        fclose(f);
+        return ok;
+    }
+
+    bool cimage::save(const char *path) const {
+        std::vector<cimage_file_sym> syms;
+        std::vector<char> strings;
+        for (auto &sym : symbols) {
+            syms.push_back({(uint32_t) strings.size(), sym.clazz, sym.data});
+            strings.insert(strings.end(), sym.name.begin(), sym.name.end());
+            strings.push_back('\0');
+        }
+        std::vector<cimage_file_syscall> calls;
+        for (auto &sys : syscalls) {
+            calls.push_back({(uint32_t) strings.size(), sys.id, sys.arity});
+            strings.insert(strings.end(), sys.name.begin(), sys.name.end());
+            strings.push_back('\0');
+        }
+        cimage_header hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, IMAGE_MAGIC, sizeof(hdr.magic));
+        hdr.version = IMAGE_VERSION;
+        hdr.entry = entry;
+        hdr.symbols = (uint32_t) syms.size();
+        hdr.syscalls = (uint32_t) calls.size();
+        hdr.strings = (uint32_t) strings.size();
+        hdr.data = (uint32_t) data.size();
+        auto meta = sizeof(hdr) + syms.size() * sizeof(cimage_file_sym) + calls.size() * sizeof(cimage_file_syscall) +
+                    strings.size() + data.size();
+        hdr.text = PAGE_ALIGN_UP((uint32_t) meta);
+        hdr.pages = code->pages;
+        // 先写临时文件再改名，其他进程不会读到写了一半的镜像
+        // 临时文件名带进程号、线程号和序号，多个进程、线程同时写入同一镜像时互不影响
+        static std::atomic<uint32_t> seq{0};
+        auto tmp = string_t(path) + "." + std::to_string(getpid()) + "." +
+                   std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + "." +
+                   std::to_string(seq++) + ".tmp";
+        auto f = fopen(tmp.c_str(), "wb");
+        if (!f)
+            return false;
+        auto ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+        ok = ok && (syms.empty() || fwrite(syms.data(), sizeof(cimage_file_sym), syms.size(), f) == syms.size());
+        ok = ok && (calls.empty() || fwrite(calls.data(), sizeof(cimage_file_syscall), calls.size(), f) == calls.size());
+        ok = ok && (strings.empty() || fwrite(strings.data(), 1, strings.size(), f) == strings.size());
+        ok = ok && (data.empty() || fwrite(data.data(), 1, data.size(), f) == data.size());
+        std::vector<byte> pad(hdr.text - meta);
+        ok = ok && (pad.empty() || fwrite(pad.data(), 1, pad.size(), f) == pad.size());
+        ok = ok && (code->pages == 0 || fwrite(code->head, PAGE_SIZE, code->pages, f) == code->pages);
+        ok = fclose(f) == 0 && ok;
+        if (ok) {
+#ifdef _MSC_VER
+            remove(path); // rename不覆盖已有文件
+#endif
+            ok = rename(tmp.c_str(), path) == 0;
+        }
+        if (!ok)
+            remove(tmp.c_str());
+        return ok;
+    }
+
+    std::unique_ptr<cimage> cimage::load(const char *path) {
+        auto map = std::make_shared<cmmap>(path);
+        auto image = map->data();
+        auto size = map->size();
+        auto hdr = (const cimage_header *) image;
+        if (!image || size < sizeof(*hdr) || memcmp(hdr->magic, IMAGE_MAGIC, sizeof(hdr->magic)) != 0) {
+            printf("IMAGE> Invalid image: %s\n", path);
+            throw std::exception();
+        }
+        if (hdr->version != IMAGE_VERSION) {
+            printf("IMAGE> Unsupported version: %d\n", hdr->version);
+            throw std::exception();
+        }
+        // 按64位计算，文件头中的计数再大也不会回绕
+        auto meta = (uint64_t) sizeof(*hdr) + (uint64_t) hdr->symbols * sizeof(cimage_file_sym) +
+                    (uint64_t) hdr->syscalls * sizeof(cimage_file_syscall) + hdr->strings + hdr->data;
+        if (meta > hdr->text || (uint64_t) hdr->text + (uint64_t) hdr->pages * PAGE_SIZE > size ||
+            (hdr->text & ~PAGE_MASK)) {
+            printf("IMAGE> Truncated image: %s\n", path);
+            throw std::exception();
+        }
+        auto syms = (const cimage_file_sym *) (hdr + 1);
+        auto calls = (const cimage_file_syscall *) (syms + hdr->symbols);
+        auto strings = (const char *) (calls + hdr->syscalls);
+        auto data = strings + hdr->strings;
+        if (hdr->strings > 0 && strings[hdr->strings - 1] != '\0') {
+            printf("IMAGE> Truncated image: %s\n", path);
+            throw std::exception();
+        }
+        if (hdr->entry < 0 || (uint64_t) hdr->entry * sizeof(int) >= (uint64_t) hdr->pages * PAGE_SIZE) {
+            printf("IMAGE> Invalid entry: %d\n", hdr->entry);
+            throw std::exception();
+        }
+        std::vector<cimage_sym> symbols;
+        for (uint32_t i = 0; i < hdr->symbols; i++) {
+            if (syms[i].name >= hdr->strings) {
+                printf("IMAGE> Invalid symbol: %d\n", i);
+                throw std::exception();
+            }
+            symbols.push_back({string_t(strings + syms[i].name), syms[i].clazz, syms[i].data});
+        }
+        std::vector<cimage_syscall> syscalls;
+        for (uint32_t i = 0; i < hdr->syscalls; i++) {
+            if (calls[i].name >= hdr->strings) {
+                printf("IMAGE> Invalid syscall: %d\n", i);
+                throw std::exception();
+            }
+            string_t name(strings + calls[i].name);
+            // 调用号已写入代码，本进程中同一调用号须为同一函数
+            auto sys = cvm::get_syscall(calls[i].id);
+            if (!sys || sys->name != name || sys->arity != calls[i].arity) {
+                printf("IMAGE> Syscall mismatch: %s (%d)\n", name.c_str(), calls[i].id);
+                throw std::exception();
+            }
+            syscalls.push_back({name, calls[i].id, calls[i].arity});
+        }
+        auto code = std::make_shared<cvm_code>(map, hdr->text, hdr->pages); // 代码页直接来自映射
+        return std::unique_ptr<cimage>(new cimage(code, std::vector<LEX_T(char)>(data, data + hdr->data),
+                                                  hdr->entry, std::move(symbols), std::move(syscalls)));
+    }
+}
@@ -0,0 +1,56 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#ifndef CMINILANG_IMAGE_H
+#define CMINILANG_IMAGE_H
+
+#include <memory>
+#include <vector>
+#include "types.h"
+#include "cvm.h"
+
+/* 镜像版本，格式或指令编码变化时递增 */
+#define IMAGE_VERSION 8
+
+namespace clib {
+
+    // 全局符号
+    struct cimage_sym {
+        string_t name;
+        int clazz; // class_t
+        int data;
+    };
+
+    // 用到的系统调用，调用号依赖注册顺序，载入时按名称和参数个数校验
+    struct cimage_syscall {
+        string_t name;
+        int id;
+        int arity;
+    };
+
+    // 编译结果：代码、数据、入口、全局符号和用到的系统调用，可保存为镜像文件
+    // 文件布局：文件头、符号表、系统调用表、字符串表、数据段，代码段按页对齐放在最后，载入时直接映射
+    class cimage {
+    public:
+        cimage(std::shared_ptr<const cvm_code> code, std::vector<LEX_T(char)> data, int entry,
+               std::vector<cimage_sym> symbols, std::vector<cimage_syscall> syscalls);
+        ~cimage() = default;
+
+        // 载入镜像，失败或系统调用与本进程的不一致时抛出异常
+        static std::unique_ptr<cimage> load(const char *path);
+        // 是否为镜像文件
+        static bool is_image(const char *path);
+        // 保存镜像，成功返回true
+        bool save(const char *path) const;
+
+        std::shared_ptr<const cvm_code> code;
+        std::vector<LEX_T(char)> data;
+        int entry;
+        std::vector<cimage_sym> symbols;
+        std::vector<cimage_syscall> syscalls;
+    };
+}
+
+#endif //CMINILANG_IMAGE_H
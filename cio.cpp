@@ -0,0 +1,54 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#include "cio.h"
+
+namespace clib {
+
+    cio::cio(int size) {
+        for (auto i = 0; i < size; ++i) {
+            threads.emplace_back([this]() { work(); });
+        }
+    }
+
+    cio::~cio() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+        }
+        cv.notify_all();
+        for (auto &th : threads) {
+            th.join();
+        }
+    }
+
+    void cio::post(job_t job) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            jobs.push_back(std::move(job));
+        }
+        cv.notify_one();
+    }
+
+    cio &cio::get() {
+        static cio io(IO_THREADS);
+        return io;
+    }
+
+    void cio::work() {
+        while (true) {
+            job_t job;
+            {
+                std::unique_lock<std::mutex> lk(lock);
+                cv.wait(lk, [this]() { return stop || !jobs.empty(); });
+                if (jobs.empty())
+                    return; // 退出前做完已提交的读写
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+}
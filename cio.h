@@ -0,0 +1,46 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#ifndef CMINILANG_IO_H
+#define CMINILANG_IO_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* I/O线程数 */
+#define IO_THREADS 4
+
+namespace clib {
+
+    // 进程内共享的I/O线程池，按提交顺序执行阻塞的读写，解释器线程不必等待
+    class cio {
+    public:
+        using job_t = std::function<void()>;
+
+        explicit cio(int size);
+        ~cio();
+
+        void post(job_t job);
+
+        // 进程内的I/O线程池，首次使用时创建
+        static cio &get();
+
+    private:
+        void work();
+
+    private:
+        std::vector<std::thread> threads;
+        std::deque<job_t> jobs;
+        std::mutex lock;
+        std::condition_variable cv;
+        bool stop{false};
+    };
+}
+
+#endif //CMINILANG_IO_H
@@ -0,0 +1,54 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#include "cminilang.h"
+#include "cgen.h"
+#include "cparser.h"
+
+namespace clib {
+
+    cprogram::cprogram(std::unique_ptr<cimage> img) : img(std::move(img)) {
+    }
+
+    std::shared_ptr<const cprogram> cprogram::compile(const string_t &source) {
+        cparser p(source);
+        auto root = p.parse();
+        cgen gen(root);
+        return std::shared_ptr<const cprogram>(new cprogram(gen.image()));
+    }
+
+    std::shared_ptr<const cprogram> cprogram::load(const char *path) {
+        return std::shared_ptr<const cprogram>(new cprogram(cimage::load(path)));
+    }
+
+    std::unique_ptr<cvm> cprogram::create() const {
+        return std::unique_ptr<cvm>(new cvm(img->code, img->data));
+    }
+
+    void cprogram::start(cvm &vm, const std::vector<string_t> &args, cvm_output out) const {
+        vm.set_output(std::move(out));
+        std::vector<char *> argv;
+        for (auto &arg : args) {
+            argv.push_back(const_cast<char *>(arg.c_str())); // init只读取参数
+        }
+        vm.init(img->entry, (int) argv.size(), argv.data());
+    }
+
+    std::unique_ptr<cvm> cprogram::instantiate(const std::vector<string_t> &args, cvm_output out) const {
+        auto vm = create();
+        start(*vm, args, std::move(out));
+        return vm;
+    }
+
+    int cprogram::run(const std::vector<string_t> &args, cvm_output out) const {
+        auto vm = instantiate(args, std::move(out));
+        vm->exec();
+        return vm->get_exit_code();
+    }
+
+    const cimage &cprogram::image() const {
+        return *img;
+    }
+}
@@ -0,0 +1,49 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#ifndef CMINILANG_CMINILANG_H
+#define CMINILANG_CMINILANG_H
+
+#include <memory>
+#include <vector>
+#include "types.h"
+#include "cimage.h"
+#include "cvm.h"
+#include "cnative.h"
+
+namespace clib {
+
+    // 编译后的程序，创建后不再修改
+    // 可在多个线程中同时用同一个程序创建、运行虚拟机，代码页由所有虚拟机共享
+    class cprogram {
+    public:
+        ~cprogram() = default;
+        cprogram(const cprogram &) = delete;
+        cprogram &operator=(const cprogram &) = delete;
+
+        // 编译源码，出错时抛出异常
+        static std::shared_ptr<const cprogram> compile(const string_t &source);
+        // 载入--emit-image生成的镜像，出错时抛出异常
+        static std::shared_ptr<const cprogram> load(const char *path);
+
+        // 创建虚拟机，只映射代码和数据，尚未设置参数，可预先创建备用
+        std::unique_ptr<cvm> create() const;
+        // 为create创建的虚拟机设置参数和输出
+        void start(cvm &vm, const std::vector<string_t> &args, cvm_output out = nullptr) const;
+        // 创建虚拟机，args为main的参数，out为空时输出到stdout
+        std::unique_ptr<cvm> instantiate(const std::vector<string_t> &args, cvm_output out = nullptr) const;
+        // 创建虚拟机并运行至结束，返回退出码
+        int run(const std::vector<string_t> &args, cvm_output out = nullptr) const;
+
+        const cimage &image() const;
+
+    private:
+        explicit cprogram(std::unique_ptr<cimage> img);
+
+        std::unique_ptr<const cimage> img;
+    };
+}
+
+#endif //CMINILANG_CMINILANG_H
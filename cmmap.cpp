@@ -0,0 +1,68 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "cmmap.h"
+#include "cvm.h"
+
+namespace clib {
+
+    cmmap::cmmap(const char *path) {
+#ifdef _MSC_VER
+        auto f = fopen(path, "rb");
+        if (!f)
+            return;
+        fseek(f, 0, SEEK_END);
+        auto size = (size_t) ftell(f);
+        fseek(f, 0, SEEK_SET);
+        base = (byte *) calloc(size + PAGE_SIZE * 2, 1); // 对齐后仍有整页，文件之后补零，与mmap一致
+        auto data = (byte *) PAGE_ALIGN_UP((uint32_t) base);
+        if (fread(data, 1, size, f) == size) {
+            head = data;
+            length = size;
+        }
+        fclose(f);
+#else
+        auto fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        // 32位下超过size_t的文件无法整个映射，不截断
+        if (fstat(fd, &st) == 0 && st.st_size > 0 && (uint64_t) st.st_size <= SIZE_MAX) {
+            auto p = mmap(nullptr, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                base = head = (byte *) p;
+                length = (size_t) st.st_size;
+            }
+        }
+        close(fd);
+#endif
+    }
+
+    cmmap::~cmmap() {
+#ifdef _MSC_VER
+        free(base);
+#else
+        if (base)
+            munmap(base, length);
+#endif
+    }
+
+    byte *cmmap::data() const {
+        return head;
+    }
+
+    size_t cmmap::size() const {
+        return length;
+    }
+}
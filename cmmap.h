@@ -0,0 +1,34 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#ifndef CMINILANG_MMAP_H
+#define CMINILANG_MMAP_H
+
+#include <cstddef>
+#include "types.h"
+
+namespace clib {
+
+    // 文件私有映射，写入不影响文件；不支持mmap的平台读入内存
+    // 数据起始地址按页对齐
+    class cmmap {
+    public:
+        explicit cmmap(const char *path);
+        ~cmmap();
+        cmmap(const cmmap &) = delete;
+        cmmap &operator=(const cmmap &) = delete;
+
+        // 打开失败时为空
+        byte *data() const;
+        size_t size() const;
+
+    private:
+        byte *base{nullptr};
+        byte *head{nullptr};
+        size_t length{0};
+    };
+}
+
+#endif //CMINILANG_MMAP_H
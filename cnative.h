@@ -0,0 +1,117 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#ifndef CMINILANG_NATIVE_H
+#define CMINILANG_NATIVE_H
+
+#include <cstring>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include "cvm.h"
+
+namespace clib {
+
+    // 宿主函数的参数、返回值与虚拟机中的值的转换
+    // 整数、枚举、float直接取栈上的参数；const char *不跨页时指向虚拟机内存，否则为副本；std::string为复制
+    // 返回字符串时复制到虚拟机的堆上，返回其地址
+    template<class T, class Enable = void>
+    struct cvm_native_type {
+        static_assert(sizeof(T) == 0, "unsupported native type");
+    };
+
+    template<class T>
+    struct cvm_native_type<T, typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type> {
+        static T get(const cvm_call &c, int i) { return (T) c.arg(i); }
+        static int put(cvm_call &, T v) { return (int) v; }
+    };
+
+    template<>
+    struct cvm_native_type<float> {
+        static float get(const cvm_call &c, int i) {
+            auto u = c.arg(i);
+            float f;
+            memcpy(&f, &u, sizeof(f));
+            return f;
+        }
+        static int put(cvm_call &, float v) {
+            int u;
+            memcpy(&u, &v, sizeof(u));
+            return u;
+        }
+    };
+
+    template<>
+    struct cvm_native_type<const char *> {
+        static const char *get(const cvm_call &c, int i) { return c.str(i); }
+        static int put(cvm_call &c, const char *v) { return (int) c.new_str(v, (uint32_t) strlen(v)); }
+    };
+
+    template<>
+    struct cvm_native_type<std::string> {
+        static std::string get(const cvm_call &c, int i) { return c.string(i); }
+        static int put(cvm_call &c, const std::string &v) { return (int) c.new_str(v.data(), (uint32_t) v.size()); }
+    };
+
+    template<class R>
+    struct cvm_native_ret {
+        template<class F>
+        static int call(cvm_call &c, F &&f) { return cvm_native_type<typename std::decay<R>::type>::put(c, f()); }
+    };
+
+    template<>
+    struct cvm_native_ret<void> {
+        template<class F>
+        static int call(cvm_call &, F &&f) {
+            f();
+            return 0;
+        }
+    };
+
+    template<class R, class... Args, std::size_t... I>
+    int cvm_native_invoke(const std::function<R(Args...)> &fn, cvm_call &c, std::index_sequence<I...>) {
+        return cvm_native_ret<R>::call(c, [&]() {
+            return fn(cvm_native_type<typename std::decay<Args>::type>::get(c, (int) I)...);
+        });
+    }
+
+    // 取可调用对象的签名
+    template<class F>
+    struct cvm_native_traits : cvm_native_traits<decltype(&F::operator())> {
+    };
+
+    template<class C, class R, class... Args>
+    struct cvm_native_traits<R (C::*)(Args...) const> {
+        using type = std::function<R(Args...)>;
+    };
+
+    template<class C, class R, class... Args>
+    struct cvm_native_traits<R (C::*)(Args...)> {
+        using type = std::function<R(Args...)>;
+    };
+
+    template<class R, class... Args>
+    struct cvm_native_traits<R (*)(Args...)> {
+        using type = std::function<R(Args...)>;
+    };
+
+    template<class R, class... Args>
+    int add_native(const string_t &name, std::function<R(Args...)> fn) {
+        return cvm::add_syscall(name, sizeof...(Args), [fn](cvm_call &c) {
+            return cvm_native_invoke(fn, c, std::index_sequence_for<Args...>());
+        });
+    }
+
+    // 注册宿主函数，参数个数和类型由函数签名得出，返回调用号，失败返回-1
+    // 与add_syscall相同，应在编译使用它的脚本之前注册
+    template<class F>
+    int add_native(const string_t &name, F fn) {
+        using type = typename cvm_native_traits<typename std::decay<F>::type>::type;
+        return add_native(name, type(fn));
+    }
+}
+
+#endif //CMINILANG_NATIVE_H
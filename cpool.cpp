@@ -0,0 +1,109 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#include <cstdint>
+#include "cpool.h"
+
+namespace clib {
+
+    cpool::cpool(int size) {
+        for (auto i = 0; i < size; ++i) {
+            ranges.emplace_back(new range_t);
+        }
+        for (auto i = 0; i < size; ++i) {
+            threads.emplace_back([this, i]() { work(i); });
+        }
+    }
+
+    cpool::~cpool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+        }
+        cv_start.notify_all();
+        for (auto &th : threads) {
+            th.join();
+        }
+    }
+
+    int cpool::size() const {
+        return (int) ranges.size();
+    }
+
+    void cpool::run(int lo, int hi, const task_t &t) {
+        if (lo >= hi)
+            return;
+        std::lock_guard<std::mutex> guard(run_lock);
+        auto n = size();
+        auto len = (int64_t) hi - lo; // 区间可能超过INT_MAX
+        for (auto i = 0; i < n; ++i) { // 均分区间
+            std::lock_guard<std::mutex> g(ranges[i]->lock);
+            ranges[i]->lo = (int) (lo + len * i / n);
+            ranges[i]->hi = (int) (lo + len * (i + 1) / n);
+        }
+        std::unique_lock<std::mutex> lk(lock);
+        task = &t;
+        active = n;
+        generation++;
+        cv_start.notify_all();
+        cv_done.wait(lk, [this]() { return active == 0; });
+        task = nullptr;
+    }
+
+    void cpool::work(int id) {
+        auto gen = 0;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lk(lock);
+                cv_start.wait(lk, [&]() { return stop || generation != gen; });
+                if (stop)
+                    return;
+                gen = generation;
+            }
+            int lo, hi;
+            while (take(id, lo, hi) || (steal(id) && take(id, lo, hi))) {
+                (*task)(id, lo, hi);
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            if (--active == 0)
+                cv_done.notify_all();
+        }
+    }
+
+    bool cpool::take(int id, int &lo, int &hi) {
+        auto &r = *ranges[id];
+        std::lock_guard<std::mutex> guard(r.lock);
+        if (r.lo >= r.hi)
+            return false;
+        auto chunk = ((int64_t) r.hi - r.lo + 1) / 2; // 取剩余的一半，块逐渐变小以平衡负载
+        lo = r.lo;
+        hi = (int) (r.lo + chunk);
+        r.lo = hi;
+        return true;
+    }
+
+    bool cpool::steal(int id) {
+        auto n = size();
+        for (auto i = 1; i < n; ++i) {
+            auto &victim = *ranges[(id + i) % n];
+            int lo, hi;
+            {
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if (victim.lo >= victim.hi)
+                    continue;
+                auto mid = (int) (victim.lo + ((int64_t) victim.hi - victim.lo) / 2); // 窃取尾部一半
+                lo = mid;
+                hi = victim.hi;
+                victim.hi = mid;
+            }
+            auto &r = *ranges[id];
+            std::lock_guard<std::mutex> guard(r.lock);
+            r.lo = lo;
+            r.hi = hi;
+            return true;
+        }
+        return false;
+    }
+}
@@ -0,0 +1,60 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#ifndef CMINILANG_POOL_H
+#define CMINILANG_POOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace clib {
+
+    // 工作窃取线程池
+    // 区间先均分给各工作线程，工作线程从自己区间的头部取块执行，
+    // 块大小为剩余区间的一半（逐步变小）；自己的区间取完后，从其他线程区间的尾部窃取一半
+    class cpool {
+    public:
+        // 工作线程号，块起点，块终点
+        using task_t = std::function<void(int, int, int)>;
+
+        explicit cpool(int size);
+        ~cpool();
+
+        int size() const;
+
+        // 在[lo, hi)上执行task，阻塞至全部完成
+        void run(int lo, int hi, const task_t &task);
+
+    private:
+        // 工作线程所属区间
+        struct range_t {
+            std::mutex lock;
+            int lo{0};
+            int hi{0};
+        };
+
+        void work(int id);
+        bool take(int id, int &lo, int &hi);
+        bool steal(int id);
+
+    private:
+        std::vector<std::thread> threads;
+        std::vector<std::unique_ptr<range_t>> ranges;
+        std::mutex lock;
+        std::mutex run_lock; // 同一时刻只执行一个区间
+        std::condition_variable cv_start;
+        std::condition_variable cv_done;
+        const task_t *task{nullptr};
+        int generation{0};
+        int active{0};
+        bool stop{false};
+    };
+}
+
+#endif //CMINILANG_POOL_H
@@ -0,0 +1,274 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <thread>
+#ifndef _MSC_VER
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#include "cserve.h"
+
+namespace clib {
+
+    cserve::cserve(const char *path) : path(path) {
+    }
+
+#ifdef _MSC_VER
+
+    int cserve::run(int workers) {
+        printf("--serve is not supported on this platform\n");
+        return -1;
+    }
+
+    int cserve::bench(const char *path, int requests, int concurrency, int argc, char **argv) {
+        printf("--bench is not supported on this platform\n");
+        return -1;
+    }
+
+#else
+
+    static bool write_all(int fd, const char *buf, size_t len) {
+        while (len > 0) {
+            auto n = write(fd, buf, len);
+            if (n <= 0)
+                return false;
+            buf += n;
+            len -= (size_t) n;
+        }
+        return true;
+    }
+
+    static bool read_all(int fd, std::vector<char> &buf) {
+        char tmp[4096];
+        for (;;) {
+            auto n = read(fd, tmp, sizeof(tmp));
+            if (n < 0)
+                return false;
+            if (n == 0)
+                return true;
+            buf.insert(buf.end(), tmp, tmp + n);
+        }
+    }
+
+    static int connect_to(const char *path) {
+        auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0)
+            return -1;
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        if (connect(fd, (sockaddr *) &addr, sizeof(addr)) != 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    int cserve::run(int workers) {
+        signal(SIGPIPE, SIG_IGN); // 客户端提前断开时write返回错误，不结束进程
+        auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) {
+            printf("serve: socket failed\n");
+            return -1;
+        }
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            printf("serve: path too long: %s\n", path.c_str());
+            return -1;
+        }
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(path.c_str());
+        if (bind(fd, (sockaddr *) &addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+            printf("serve: cannot listen on %s\n", path.c_str());
+            close(fd);
+            return -1;
+        }
+        printf("serving on %s with %d workers\n", path.c_str(), workers);
+        fflush(stdout);
+        std::vector<std::thread> threads;
+        for (auto i = 0; i < workers; i++) {
+            threads.emplace_back(&cserve::work, this, fd);
+        }
+        for (auto &th : threads) {
+            th.join();
+        }
+        close(fd);
+        return 0;
+    }
+
+    void cserve::work(int fd) {
+        for (;;) {
+            auto conn = accept(fd, nullptr, nullptr);
+            if (conn < 0)
+                continue;
+            handle(conn);
+        }
+    }
+
+    void cserve::handle(int conn) {
+        std::vector<char> req;
+        if (!read_all(conn, req) || req.empty()) {
+            close(conn);
+            return;
+        }
+        req.push_back('\0');
+        std::vector<string_t> args;
+        for (size_t i = 0; i + 1 < req.size(); i += strlen(&req[i]) + 1) {
+            args.emplace_back(&req[i]);
+        }
+        auto file = args.front();
+        std::shared_ptr<const cprogram> prog;
+        try {
+            prog = program(file);
+            if (!prog) {
+                auto msg = "ERROR: cannot open " + file + "\n";
+                write_all(conn, msg.c_str(), msg.size());
+                close(conn);
+                return;
+            }
+            auto vm = acquire(file, prog);
+            prog->start(*vm, args, [=](const char *buf, uint len) {
+                write_all(conn, buf, len);
+            });
+            // 分片运行，脚本不结束时不会一直占用工作线程
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(SERVE_TIMEOUT);
+            while (vm->exec(SERVE_SLICE) != vm_exit) {
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    vm->flush();
+                    string_t msg = "ERROR: timeout\n";
+                    write_all(conn, msg.c_str(), msg.size());
+                    break;
+                }
+                vm->wait();
+            }
+        } catch (const std::exception &e) {
+            auto msg = string_t("ERROR: ") + e.what() + "\n";
+            write_all(conn, msg.c_str(), msg.size());
+        }
+        close(conn);
+        if (prog)
+            refill(file, prog);
+    }
+
+    std::shared_ptr<const cprogram> cserve::program(const string_t &file) {
+        struct stat st;
+        if (stat(file.c_str(), &st) != 0)
+            return nullptr;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = entries.find(file);
+            if (it != entries.end() && it->second.mtime == st.st_mtime)
+                return it->second.prog;
+        }
+        // 编译不持锁，多个线程同时编译同一文件时后完成的覆盖先完成的
+        std::shared_ptr<const cprogram> prog;
+        if (cimage::is_image(file.c_str())) {
+            prog = cprogram::load(file.c_str());
+        } else {
+            std::ifstream in(file);
+            std::istreambuf_iterator<char> beg(in), end;
+            prog = cprogram::compile(string_t(beg, end));
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        auto &entry = entries[file];
+        entry.mtime = st.st_mtime;
+        entry.prog = prog;
+        entry.idle.clear();
+        return prog;
+    }
+
+    std::unique_ptr<cvm> cserve::acquire(const string_t &file, const std::shared_ptr<const cprogram> &prog) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto &entry = entries[file];
+            if (entry.prog == prog && !entry.idle.empty()) {
+                auto vm = std::move(entry.idle.back());
+                entry.idle.pop_back();
+                return vm;
+            }
+        }
+        return prog->create();
+    }
+
+    void cserve::refill(const string_t &file, const std::shared_ptr<const cprogram> &prog) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto &entry = entries[file];
+            if (entry.prog != prog || entry.idle.size() >= SERVE_IDLE_MAX)
+                return;
+        }
+        auto vm = prog->create();
+        std::lock_guard<std::mutex> guard(lock);
+        auto &entry = entries[file];
+        if (entry.prog == prog && entry.idle.size() < SERVE_IDLE_MAX)
+            entry.idle.push_back(std::move(vm));
+    }
+
+    int cserve::bench(const char *path, int requests, int concurrency, int argc, char **argv) {
+        std::vector<char> req;
+        for (auto i = 0; i < argc; i++) {
+            req.insert(req.end(), argv[i], argv[i] + strlen(argv[i]) + 1);
+        }
+        std::atomic<int> next{0};
+        std::atomic<int> failed{0};
+        std::atomic<long long> bytes{0};
+        std::mutex lat_lock;
+        std::vector<double> lats;
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (auto i = 0; i < concurrency; i++) {
+            threads.emplace_back([&]() {
+                std::vector<double> mine;
+                while (next++ < requests) {
+                    auto t0 = std::chrono::steady_clock::now();
+                    auto fd = connect_to(path);
+                    std::vector<char> resp;
+                    if (fd < 0 || !write_all(fd, req.data(), req.size()) || shutdown(fd, SHUT_WR) != 0 ||
+                        !read_all(fd, resp)) {
+                        failed++;
+                        if (fd >= 0)
+                            close(fd);
+                        continue;
+                    }
+                    close(fd);
+                    bytes += resp.size();
+                    mine.push_back(std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - t0).count());
+                }
+                std::lock_guard<std::mutex> guard(lat_lock);
+                lats.insert(lats.end(), mine.begin(), mine.end());
+            });
+        }
+        for (auto &th : threads) {
+            th.join();
+        }
+        auto total = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (lats.empty()) {
+            printf("bench: all %d requests failed\n", (int) failed);
+            return -1;
+        }
+        std::sort(lats.begin(), lats.end());
+        auto pct = [&](double p) { return lats[std::min(lats.size() - 1, (decltype(lats.size())) (p * lats.size()))]; };
+        printf("requests: %d, failed: %d, output: %lld bytes\n", (int) lats.size(), (int) failed, (long long) bytes);
+        printf("latency(ms): p50 %.3f, p99 %.3f, max %.3f\n", pct(0.5), pct(0.99), lats.back());
+        printf("throughput: %.1f req/s\n", lats.size() / total);
+        return 0;
+    }
+
+#endif
+}
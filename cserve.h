@@ -0,0 +1,64 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#ifndef CMINILANG_SERVE_H
+#define CMINILANG_SERVE_H
+
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "types.h"
+#include "cminilang.h"
+
+/* 每个程序预先创建的虚拟机数 */
+#define SERVE_IDLE_MAX 4
+/* 每个请求每次连续执行的指令数 */
+#define SERVE_SLICE 100000
+/* 每个请求的运行时限（秒），超时后放弃该请求 */
+#define SERVE_TIMEOUT 10
+
+namespace clib {
+
+    // 常驻服务：在Unix域套接字上接收运行请求，程序编译后常驻内存，并预先创建好虚拟机
+    // 请求为以'\0'分隔的脚本路径（或镜像）和参数，客户端写完后关闭写端；
+    // 应答为脚本的输出，服务端写完后关闭连接
+    class cserve {
+    public:
+        explicit cserve(const char *path);
+        ~cserve() = default;
+
+        // 用workers个线程处理请求，不返回
+        int run(int workers);
+
+        // 压测：用concurrency个连接共发送requests个请求，输出延迟分布
+        static int bench(const char *path, int requests, int concurrency, int argc, char **argv);
+
+    private:
+        // 程序及备用的虚拟机
+        struct entry_t {
+            time_t mtime{0};
+            std::shared_ptr<const cprogram> prog;
+            std::vector<std::unique_ptr<cvm>> idle;
+        };
+
+        void work(int fd);
+        void handle(int conn);
+        // 取程序，文件修改后重新编译
+        std::shared_ptr<const cprogram> program(const string_t &file);
+        // 取备用虚拟机，没有时新建
+        std::unique_ptr<cvm> acquire(const string_t &file, const std::shared_ptr<const cprogram> &prog);
+        // 补充备用虚拟机，在应答之后调用，不占用请求的时间
+        void refill(const string_t &file, const std::shared_ptr<const cprogram> &prog);
+
+    private:
+        string_t path;
+        std::mutex lock;
+        std::map<string_t, entry_t> entries;
+    };
+}
+
+#endif //CMINILANG_SERVE_H
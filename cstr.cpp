@@ -0,0 +1,191 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+// GCC/Clang：各内核按目标属性编译，运行时按CPU选择，不依赖-msse2/-mavx2
+#include <immintrin.h>
+#define CSTR_DISPATCH
+#define CSTR_SSE2
+#define CSTR_AVX2
+#define CSTR_TARGET(t) __attribute__((target(t)))
+#else
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CSTR_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define CSTR_SSE2
+#endif
+#define CSTR_TARGET(t)
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include "cstr.h"
+
+namespace clib {
+
+#ifdef _MSC_VER
+    static inline uint32_t first_bit(uint32_t mask) {
+        unsigned long i;
+        _BitScanForward(&i, mask);
+        return (uint32_t) i;
+    }
+#else
+    static inline uint32_t first_bit(uint32_t mask) {
+        return (uint32_t) __builtin_ctz(mask);
+    }
+#endif
+
+    static uint32_t find_from(const char *p, uint32_t i, uint32_t n, char c) {
+        for (; i < n; ++i) {
+            if (p[i] == c || p[i] == 0)
+                return i;
+        }
+        return n;
+    }
+
+    static uint32_t diff_from(const char *a, const char *b, uint32_t i, uint32_t n) {
+        for (; i < n; ++i) {
+            if (a[i] != b[i] || a[i] == 0)
+                return i;
+        }
+        return n;
+    }
+
+    static uint32_t find_scalar(const char *p, uint32_t n, char c) {
+        return find_from(p, 0, n, c);
+    }
+
+    static uint32_t diff_scalar(const char *a, const char *b, uint32_t n) {
+        return diff_from(a, b, 0, n);
+    }
+
+#ifdef CSTR_SSE2
+    CSTR_TARGET("sse2")
+    static uint32_t find_sse2(const char *p, uint32_t n, char c) {
+        uint32_t i = 0;
+        auto vc = _mm_set1_epi8(c);
+        auto vz = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16) {
+            auto v = _mm_loadu_si128((const __m128i *) (p + i));
+            auto mask = (uint32_t) _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(v, vz)));
+            if (mask)
+                return i + first_bit(mask);
+        }
+        return find_from(p, i, n, c);
+    }
+
+    CSTR_TARGET("sse2")
+    static uint32_t diff_sse2(const char *a, const char *b, uint32_t n) {
+        uint32_t i = 0;
+        auto vz = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16) {
+            auto va = _mm_loadu_si128((const __m128i *) (a + i));
+            auto vb = _mm_loadu_si128((const __m128i *) (b + i));
+            auto same = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+            auto zero = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(va, vz));
+            auto mask = (~same & 0xffff) | zero;
+            if (mask)
+                return i + first_bit(mask);
+        }
+        return diff_from(a, b, i, n);
+    }
+#endif
+
+#ifdef CSTR_AVX2
+    CSTR_TARGET("avx2")
+    static uint32_t find_avx2(const char *p, uint32_t n, char c) {
+        uint32_t i = 0;
+        auto vc = _mm256_set1_epi8(c);
+        auto vz = _mm256_setzero_si256();
+        for (; i + 32 <= n; i += 32) {
+            auto v = _mm256_loadu_si256((const __m256i *) (p + i));
+            auto mask = (uint32_t) _mm256_movemask_epi8(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, vc), _mm256_cmpeq_epi8(v, vz)));
+            if (mask)
+                return i + first_bit(mask);
+        }
+        return find_from(p, i, n, c);
+    }
+
+    CSTR_TARGET("avx2")
+    static uint32_t diff_avx2(const char *a, const char *b, uint32_t n) {
+        uint32_t i = 0;
+        auto vz = _mm256_setzero_si256();
+        for (; i + 32 <= n; i += 32) {
+            auto va = _mm256_loadu_si256((const __m256i *) (a + i));
+            auto vb = _mm256_loadu_si256((const __m256i *) (b + i));
+            auto same = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+            auto zero = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vz));
+            auto mask = ~same | zero;
+            if (mask)
+                return i + first_bit(mask);
+        }
+        return diff_from(a, b, i, n);
+    }
+#endif
+
+    using find_fn = uint32_t (*)(const char *, uint32_t, char);
+    using diff_fn = uint32_t (*)(const char *, const char *, uint32_t);
+
+    // 选择本机支持的最宽的内核
+    static int str_level() {
+#if defined(CSTR_DISPATCH)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return 2;
+        if (__builtin_cpu_supports("sse2"))
+            return 1;
+        return 0;
+#elif defined(CSTR_AVX2)
+        return 2;
+#elif defined(CSTR_SSE2)
+        return 1;
+#else
+        return 0;
+#endif
+    }
+
+    static find_fn find_select() {
+        switch (str_level()) {
+#ifdef CSTR_AVX2
+            case 2:
+                return find_avx2;
+#endif
+#ifdef CSTR_SSE2
+            case 1:
+                return find_sse2;
+#endif
+            default:
+                return find_scalar;
+        }
+    }
+
+    static diff_fn diff_select() {
+        switch (str_level()) {
+#ifdef CSTR_AVX2
+            case 2:
+                return diff_avx2;
+#endif
+#ifdef CSTR_SSE2
+            case 1:
+                return diff_sse2;
+#endif
+            default:
+                return diff_scalar;
+        }
+    }
+
+    uint32_t str_find(const char *p, uint32_t n, char c) {
+        static const auto fn = find_select();
+        return fn(p, n, c);
+    }
+
+    uint32_t str_diff(const char *a, const char *b, uint32_t n) {
+        static const auto fn = diff_select();
+        return fn(a, b, n);
+    }
+}
@@ -0,0 +1,22 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#ifndef CMINILANG_STR_H
+#define CMINILANG_STR_H
+
+#include "types.h"
+
+namespace clib {
+
+    // 字符串内核，只读取[p, p + n)，调用者按页切分
+    // 运行时按CPU选择AVX2/SSE2内核，每次比较32/16字节，都不支持时逐字节
+
+    // 第一个c或'\0'的下标，没有时返回n
+    uint32_t str_find(const char *p, uint32_t n, char c);
+    // 第一个不同或同为'\0'的下标，没有时返回n
+    uint32_t str_diff(const char *a, const char *b, uint32_t n);
+}
+
+#endif //CMINILANG_STR_H
@@ -3,50 +3,56 @@
 // Author: bajdcc
 //
 
+#include <algorithm>
 #include <cassert>
+#include <cstdarg>
 #include <memory.h>
+#include <cstdint>
 #include <cstring>
+#include <chrono>
+#ifdef _MSC_VER
+#include <io.h>
+#define isatty _isatty
+#define fileno _fileno
+#else
+#include <unistd.h>
+#endif
 #include "cvm.h"
 #include "cgen.h"
-
-int g_argc;
-char **g_argv;
+#include "cchan.h"
+#include "cio.h"
+#include "cstr.h"
 
 namespace clib {
 
 #define INC_PTR 4
-#define VMM_ARG(s, p) ((s) + p * INC_PTR)
-#define VMM_ARGS(t, n) vmm_get(t - (n) * INC_PTR)
 
     uint32_t cvm::pmm_alloc() {
-        auto page = PAGE_ALIGN_UP((uint32_t) memory.alloc_array<byte>(PAGE_SIZE * 2));
+        std::lock_guard<std::recursive_mutex> guard(mm_lock);
+        auto page = PAGE_ALIGN_UP((uint32_t) mem->memory.alloc_array<byte>(PAGE_SIZE * 2));
+        if (page == 0) {
+            printf("out of memory");
+            throw std::exception();
+        }
         memset((void *) page, 0, PAGE_SIZE);
         return page;
     }
 
     void cvm::vmm_init() {
-        pgd_kern = (pde_t *) malloc(PTE_SIZE * sizeof(pde_t));
-        memset(pgd_kern, 0, PTE_SIZE * sizeof(pde_t));
-        pte_kern = (pte_t *) malloc(PTE_COUNT * PTE_SIZE * sizeof(pte_t));
-        memset(pte_kern, 0, PTE_COUNT * PTE_SIZE * sizeof(pte_t));
+        // 只分配页目录，页表在映射用户地址时按需申请
+        // 内核地址不经过页表转换，无需预先建立4G的恒等映射
+        pgd_kern = (pde_t *) calloc(PTE_SIZE, sizeof(pde_t));
         pgdir = pgd_kern;
 
-        uint32_t i;
-
-        // map 4G memory, physcial address = virtual address
-        for (i = 0; i < PTE_SIZE; i++) {
-            pgd_kern[i] = (uint32_t) pte_kern[i] | PTE_P | PTE_R | PTE_K;
-        }
-
-        uint32_t *pte = (uint32_t *) pte_kern;
-        for (i = 1; i < PTE_COUNT * PTE_SIZE; i++) {
-            pte[i] = (i << 12) | PTE_P | PTE_R | PTE_K; // i是页表号
+        for (uint32_t i = 0; i < PTE_SIZE; i++) {
+            pgd_kern[i] = PTE_P | PTE_R | PTE_K;
         }
     }
 
     // 虚页映射
     // va = 虚拟地址  pa = 物理地址
     void cvm::vmm_map(uint32_t va, uint32_t pa, uint32_t flags) {
+        std::lock_guard<std::recursive_mutex> guard(mm_lock);
         uint32_t pde_idx = PDE_INDEX(va); // 页目录号
         uint32_t pte_idx = PTE_INDEX(va); // 页表号
 
@@ -100,6 +106,42 @@ namespace clib {
         return 0; // 页表项不存在
     }
 
+    pte_t *cvm::vmm_pte(uint32_t va) const {
+        auto pte = (pte_t *) (pgdir[PDE_INDEX(va)] & PAGE_MASK);
+        if (!pte || !(pte[PTE_INDEX(va)] & PTE_P)) {
+            return nullptr;
+        }
+        return &pte[PTE_INDEX(va)];
+    }
+
+    void cvm::vmm_cow(uint32_t va, pte_t *pte) {
+        std::lock_guard<std::recursive_mutex> guard(mm_lock);
+        if (!(*pte & PTE_COW)) {
+            return; // 其他线程已复制
+        }
+        auto old = *pte & PAGE_MASK;
+        auto page = (uint32_t) mem->alloc_frame(); // 页框可能仍被其他虚拟机共享，总是复制到新页框
+        memcpy((void *) page, (void *) old, PAGE_SIZE);
+        *pte = page | (*pte & ~PAGE_MASK & ~PTE_COW) | PTE_R;
+#if 0
+        printf("COW> V=%08X P=%08X -> %08X\n", va, old, page);
+#endif
+    }
+
+    byte *cvm::vmm_wptr(uint32_t va) {
+        auto pte = vmm_pte(va);
+        if (!pte) {
+            return nullptr;
+        }
+        if (*pte & PTE_COW) {
+            vmm_cow(va, pte); // 写时复制
+        } else if (!(*pte & PTE_R)) {
+            printf("VMMWRITE> Read-only VA: %08X\n", va);
+            throw std::exception();
+        }
+        return (byte *) (*pte & PAGE_MASK) + OFFSET_INDEX(va);
+    }
+
     char *cvm::vmm_getstr(uint32_t va) {
         uint32_t pa;
         if (vmm_ismap(va, &pa)) {
@@ -129,9 +171,9 @@ namespace clib {
 
     template<class T>
     T cvm::vmm_set(uint32_t va, T value) {
-        uint32_t pa;
-        if (vmm_ismap(va, &pa)) {
-            *(T *) ((byte *) pa + OFFSET_INDEX(va)) = value;
+        auto p = vmm_wptr(va);
+        if (p) {
+            *(T *) p = value;
             return value;
         }
         vmm_map(va, pmm_alloc(), PTE_U | PTE_P | PTE_R);
@@ -150,37 +192,370 @@ namespace clib {
         vmm_set(va + len, '\0');
     }
 
-    uint32_t vmm_pa2va(uint32_t base, uint32_t size, uint32_t pa) {
-        return base + (pa & (SEGMENT_MASK));
+    bool cvm::vmm_isspan(uint32_t va, uint32_t size) const {
+        uint32_t pa;
+        for (auto page = PAGE_ALIGN_DOWN(va); page < va + size; page += PAGE_SIZE) {
+            if (!vmm_ismap(page, &pa))
+                return false;
+        }
+        return true;
+    }
+
+    bool cvm::vmm_iswspan(uint32_t va, uint32_t size) const {
+        for (auto page = PAGE_ALIGN_DOWN(va); page < va + size; page += PAGE_SIZE) {
+            auto pte = vmm_pte(page);
+            if (!pte || !(*pte & (PTE_R | PTE_COW)))
+                return false;
+        }
+        return true;
+    }
+
+    void cvm::vmm_read(uint32_t va, void *dst, uint32_t size) {
+        auto p = (byte *) dst;
+        uint32_t pa;
+        while (size > 0) {
+            uint32_t n = PAGE_SIZE - OFFSET_INDEX(va); // 本页剩余
+            if (n > size)
+                n = size;
+            if (!vmm_ismap(va, &pa)) {
+                printf("VMMREAD> Invalid VA: %08X\n", va);
+                throw std::exception();
+            }
+            memcpy(p, (byte *) pa + OFFSET_INDEX(va), n);
+            va += n;
+            p += n;
+            size -= n;
+        }
+    }
+
+    void cvm::vmm_write(uint32_t va, const void *src, uint32_t size) {
+        auto p = (const byte *) src;
+        while (size > 0) {
+            uint32_t n = PAGE_SIZE - OFFSET_INDEX(va); // 本页剩余
+            if (n > size)
+                n = size;
+            auto dst = vmm_wptr(va);
+            if (!dst) {
+                printf("VMMWRITE> Invalid VA: %08X\n", va);
+                throw std::exception();
+            }
+            memcpy(dst, p, n);
+            va += n;
+            p += n;
+            size -= n;
+        }
+    }
+
+    int cvm::file_open(const char *path, int flags) {
+        auto f = cfile::open(path, flags);
+        if (!f)
+            return -1;
+        std::lock_guard<std::mutex> guard(file_lock);
+        for (auto i = 3; i < FILE_MAX; ++i) { // 取最小的空闲句柄
+            if (i == (int) files.size())
+                files.emplace_back();
+            if (!files[i]) {
+                files[i] = f;
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    int cvm::file_close(int fd) {
+        std::shared_ptr<cfile> f;
+        {
+            std::lock_guard<std::mutex> guard(file_lock);
+            if (fd < 3 || fd >= (int) files.size() || !files[fd])
+                return -1;
+            f.swap(files[fd]);
+        }
+        return 0; // 其他线程或fork出的虚拟机仍在使用时，由最后一个引用关闭
+    }
+
+    std::shared_ptr<cfile> cvm::file_get(int fd) {
+        std::lock_guard<std::mutex> guard(file_lock);
+        if (fd < 0 || fd >= (int) files.size())
+            return nullptr;
+        return files[fd];
+    }
+
+    chash &cvm::coll_map(int h, const char *fn) {
+        if (h <= 0 || h > (int) maps.size() || !maps[h - 1]) {
+            printf("%s: invalid map %d\n", fn, h);
+            throw std::exception();
+        }
+        return *maps[h - 1];
+    }
+
+    std::vector<int> &cvm::coll_vec(int h, const char *fn) {
+        if (h <= 0 || h > (int) vecs.size() || !vecs[h - 1]) {
+            printf("%s: invalid vec %d\n", fn, h);
+            throw std::exception();
+        }
+        return *vecs[h - 1];
+    }
+
+    // 放入第一个空位，返回句柄，已满时返回-1
+    template<class T>
+    static int coll_add(std::vector<std::unique_ptr<T>> &table, T *p) {
+        std::unique_ptr<T> ptr(p);
+        for (int i = 0; i < COLL_MAX; i++) {
+            if (i == (int) table.size())
+                table.emplace_back();
+            if (!table[i]) {
+                table[i] = std::move(ptr);
+                return i + 1;
+            }
+        }
+        return -1;
+    }
+
+    template<class T>
+    static int coll_free(std::vector<std::unique_ptr<T>> &table, int h) {
+        if (h <= 0 || h > (int) table.size() || !table[h - 1])
+            return -1;
+        table[h - 1].reset();
+        return 0;
+    }
+
+    template<class T>
+    static void coll_copy(std::vector<std::unique_ptr<T>> &dst, const std::vector<std::unique_ptr<T>> &src) {
+        dst.resize(src.size());
+        for (uint i = 0; i < src.size(); i++) {
+            if (src[i])
+                dst[i].reset(new T(*src[i]));
+        }
+    }
+
+    int cvm::file_read(int fd, uint32_t va, uint32_t size, bool at, int64_t offset) {
+        auto f = file_get(fd);
+        if (!f)
+            return -1;
+        int total = 0;
+        while (size > 0) {
+            uint32_t n = PAGE_SIZE - OFFSET_INDEX(va); // 本页剩余
+            if (n > size)
+                n = size;
+            auto dst = vmm_wptr(va); // 直接读入虚拟机页面
+            if (!dst) {
+                printf("READ> Invalid VA: %08X\n", va);
+                throw std::exception();
+            }
+            auto got = at ? f->pread(dst, n, offset + total) : f->read(dst, n);
+            if (got < 0)
+                return total > 0 ? total : -1;
+            total += got;
+            if ((uint32_t) got < n)
+                break;
+            va += n;
+            size -= n;
+        }
+        return total;
+    }
+
+    int cvm::file_write(int fd, uint32_t va, uint32_t size) {
+        std::shared_ptr<cfile> f;
+        if (fd != 1 && !(f = file_get(fd)))
+            return -1;
+        std::unique_lock<std::mutex> guard(out_lock, std::defer_lock);
+        if (!f)
+            guard.lock();
+        auto line = false;
+        int total = 0;
+        while (size > 0) {
+            uint32_t n;
+            auto src = vmm_page(va, &n); // 逐页直接写出
+            if (n > size)
+                n = size;
+            if (f) {
+                auto put = f->write(src, n);
+                if (put < 0)
+                    return total > 0 ? total : -1;
+                total += put;
+                if ((uint32_t) put < n)
+                    break;
+            } else {
+                if (outline && !line && memchr(src, '\n', n))
+                    line = true;
+                out_write(src, n);
+                total += n;
+            }
+            va += n;
+            size -= n;
+        }
+        if (line)
+            flush_locked();
+        return total;
+    }
+
+    // I/O线程访问虚拟机前调用，虚拟机已析构时返回false
+    static bool io_enter(cvm_io_ctl &ctl) {
+        std::lock_guard<std::mutex> guard(ctl.lock);
+        if (!ctl.alive)
+            return false;
+        ctl.running++;
+        return true;
+    }
+
+    static void io_leave(cvm_io_ctl &ctl) {
+        std::lock_guard<std::mutex> guard(ctl.lock);
+        ctl.running--;
+        ctl.cv.notify_all();
+    }
+
+    int cvm::io_submit(bool write, int fd, uint32_t va, uint32_t size) {
+        int id;
+        {
+            std::lock_guard<std::mutex> guard(io_lock);
+            for (id = 0; id < (int) ios.size() && ios[id].used; ++id);
+            if (id == (int) ios.size()) {
+                if (id >= IO_MAX)
+                    return -1;
+                ios.emplace_back();
+            }
+            ios[id] = cvm_io();
+            ios[id].used = true;
+        }
+        auto ctl = io_ctl;
+        auto f = fd == 1 ? nullptr : file_get(fd);
+        if (f && f->may_block()) {
+            // 不占用共享的线程池，也不在读写时访问虚拟机内存
+            if (write ? !vmm_isspan(va, size) : !vmm_iswspan(va, size)) {
+                io_complete(id, -1); // 缓冲区无效
+                return id;
+            }
+            std::vector<byte> buf(size);
+            if (write)
+                vmm_read(va, buf.data(), size);
+            std::thread([this, ctl, f, id, write, va, size](std::vector<byte> buf) {
+                auto result = write ? f->write(buf.data(), size) : f->read(buf.data(), size);
+                if (!io_enter(*ctl))
+                    return;
+                if (!write && result > 0) {
+                    try {
+                        vmm_write(va, buf.data(), (uint32_t) result);
+                    } catch (const std::exception &) {
+                        result = -1;
+                    }
+                }
+                io_complete(id, result);
+                io_leave(*ctl);
+            }, std::move(buf)).detach();
+            return id;
+        }
+        cio::get().post([this, ctl, id, write, fd, va, size]() {
+            if (!io_enter(*ctl))
+                return; // 虚拟机已析构，取消
+            int result;
+            try {
+                result = write ? file_write(fd, va, size) : file_read(fd, va, size);
+            } catch (const std::exception &) {
+                result = -1; // 缓冲区无效
+            }
+            io_complete(id, result);
+            io_leave(*ctl);
+        });
+        return id;
+    }
+
+    void cvm::io_complete(int id, int result) {
+        std::lock_guard<std::mutex> guard(io_lock);
+        ios[id].done = true;
+        ios[id].result = result;
+        io_cv.notify_all();
+    }
+
+    bool cvm::io_done(int id) const {
+        return id < 0 || id >= (int) ios.size() || !ios[id].used || ios[id].done;
+    }
+
+    bool cvm::io_result(int id, int *result) {
+        std::lock_guard<std::mutex> guard(io_lock);
+        if (!io_done(id))
+            return false;
+        if (id < 0 || id >= (int) ios.size() || !ios[id].used) {
+            *result = -1;
+        } else {
+            *result = ios[id].result;
+            ios[id].used = false;
+        }
+        return true;
+    }
+
+    void cvm::io_wait(int id) {
+        std::unique_lock<std::mutex> lk(io_lock);
+        io_cv.wait(lk, [=]() { return io_done(id); });
+    }
+
+    void cvm::io_wait_any() {
+        std::unique_lock<std::mutex> lk(io_lock);
+        io_cv.wait(lk, [this]() {
+            auto waiting = false;
+            for (auto &task : tasks) {
+                if (task.state == task_io) {
+                    if (io_done(task.join))
+                        return true;
+                    waiting = true;
+                }
+            }
+            return !waiting;
+        });
     }
 
     uint32_t cvm::vmm_malloc(uint32_t size) {
+        std::lock_guard<std::recursive_mutex> guard(mm_lock);
 #if 0
-        printf("MALLOC> Available: %08X\n", heap.available() * 0x10);
+        printf("MALLOC> Available: %08X\n", HEAP_SIZE * PAGE_SIZE - heap_brk);
 #endif
-        auto ptr = heap.alloc_array<byte>(size);
-        if (ptr == nullptr) {
+        // 堆只增不减，分配即移动堆顶，按16B对齐
+        auto aligned = (size + 15) & ~15U;
+        if (aligned < size || aligned >= HEAP_SIZE * PAGE_SIZE - heap_brk) {
             printf("out of memory");
-            exit(-1);
+            throw std::exception();
         }
-        if (ptr < heapHead) {
-            heap.alloc_array<byte>(heapHead - ptr);
+        auto va = HEAP_BASE + heap_brk;
+        heap_brk += aligned;
 #if 0
-            printf("MALLOC> Skip %08X bytes\n", heapHead - ptr);
+        printf("MALLOC> V=%08X> %08X bytes\n", va, size);
 #endif
-            return vmm_malloc(size);
-        }
-        if (ptr + size >= heapHead + HEAP_SIZE * PAGE_SIZE) {
-            printf("out of memory");
-            exit(-1);
+        return va;
+    }
+
+    uint32_t cvm::vmm_mmap(const char *path) {
+        std::unique_ptr<cmmap> map(new cmmap(path));
+        auto data = map->data();
+        auto size = map->size();
+        if (!data || size >= MMAP_SIZE)
+            return 0;
+        std::lock_guard<std::recursive_mutex> guard(mm_lock);
+        auto pages = PAGE_ALIGN_UP((uint32_t) size) / PAGE_SIZE;
+        auto full = size % PAGE_SIZE == 0; // 最后一页已满，再映射一个全零页作结尾
+        if ((pages + full + 1) * PAGE_SIZE > MMAP_SIZE - map_brk) // 含保护页，map_brk不超过MMAP_SIZE
+            return 0;
+        auto va = MMAP_BASE + map_brk;
+        for (uint32_t i = 0; i < pages; ++i) {
+            vmm_map(va + PAGE_SIZE * i, (uint32_t) data + PAGE_SIZE * i, PTE_U | PTE_P); // 只读
         }
-        auto va = vmm_pa2va(HEAP_BASE, HEAP_SIZE, ((uint32_t) ptr - (uint32_t) heapHead));
+        if (full)
+            vmm_map(va + PAGE_SIZE * pages, pmm_alloc(), PTE_U | PTE_P);
+        map_brk += (pages + full + 1) * PAGE_SIZE; // 留一页作保护
+        mem->maps.push_back(std::move(map));
 #if 0
-        printf("MALLOC> V=%08X P=%p> %08X bytes\n", va, ptr, size);
+        printf("MMAP> V=%08X size=%08X %s\n", va, (uint32_t) size, path);
 #endif
         return va;
     }
 
+    std::atomic<int> *cvm::vmm_atomic(uint32_t va) {
+        auto p = (va & (sizeof(int) - 1)) == 0 ? vmm_wptr(va) : nullptr;
+        if (p) {
+            return (std::atomic<int> *) p;
+        }
+        printf("VMMATOMIC> Invalid VA: %08X\n", va);
+        throw std::exception();
+    }
+
     uint32_t cvm::vmm_memset(uint32_t va, uint32_t value, uint32_t count) {
 #if 0
         uint32_t pa;
@@ -231,24 +606,65 @@ namespace clib {
 
     //-----------------------------------------
 
-    cvm::cvm(const std::vector<LEX_T(int)> &text, const std::vector<LEX_T(char)> &data) {
+    cvm_mem::cvm_mem() {
+        heapBase = (byte *) calloc(HEAP_SIZE + 1, PAGE_SIZE); // 大块calloc由mmap提供，页面按需清零，无需memset
+        heapHead = (byte *) PAGE_ALIGN_UP((uint32_t) heapBase);
+    }
+
+    cvm_mem::~cvm_mem() {
+        free(heapBase);
+        for (auto &frame : frames) {
+            free(frame);
+        }
+    }
+
+    byte *cvm_mem::alloc_frame() {
+        auto frame = (byte *) malloc(PAGE_SIZE * 2);
+        if (!frame) {
+            printf("out of memory");
+            throw std::exception();
+        }
+        frames.push_back(frame);
+        return (byte *) PAGE_ALIGN_UP((uint32_t) frame);
+    }
+
+    cvm::cvm() : mem(std::make_shared<cvm_mem>()), chans(std::make_shared<cchan_set>()) {
         vmm_init();
+        set_output(nullptr);
+        files = {cfile::wrap(stdin), nullptr, cfile::wrap(stderr)}; // 标准输出即虚拟机的输出
+        syscall_count(); // 直接运行镜像时也要先注册内建函数
+    }
+
+    cvm_code::cvm_code(const std::vector<LEX_T(int)> &text) {
+        pages = PAGE_ALIGN_UP((uint32_t) (text.size() * sizeof(int))) / PAGE_SIZE;
+        base = (byte *) calloc(pages + 1, PAGE_SIZE);
+        head = (byte *) PAGE_ALIGN_UP((uint32_t) base);
+        for (uint32_t i = 0; i < text.size(); ++i) {
+            *((uint32_t *) head + i) = (uint) text[i];
+        }
+    }
+
+    cvm_code::cvm_code(std::shared_ptr<cmmap> map, uint32_t offset, uint32_t pages)
+            : base(nullptr), head(map->data() + offset), pages(pages), map(map) {
+    }
+
+    cvm_code::~cvm_code() {
+        free(base);
+    }
+
+    cvm::cvm(const std::vector<LEX_T(int)> &text, const std::vector<LEX_T(char)> &data)
+            : cvm(std::make_shared<cvm_code>(text), data) {
+    }
+
+    cvm::cvm(std::shared_ptr<const cvm_code> code, const std::vector<LEX_T(char)> &data) : cvm() {
+        this->code = code;
         uint32_t pa;
-        /* 映射4KB的代码空间 */
-        {
-            auto size = PAGE_SIZE / sizeof(int);
-            for (uint32_t i = 0, start = 0; start < text.size(); ++i, start += size) {
-                vmm_map(USER_BASE + PAGE_SIZE * i, (uint32_t) pmm_alloc(), PTE_U | PTE_P | PTE_R); // 用户代码空间
-                if (vmm_ismap(USER_BASE + PAGE_SIZE * i, &pa)) {
-                    auto s = start + size > text.size() ? (text.size() & (size - 1)) : size;
-                    for (uint32_t j = 0; j < s; ++j) {
-                        *((uint32_t *) pa + j) = (uint) text[start + j];
+        /* 映射代码空间，只读，与同一程序的其他虚拟机共享 */
+        for (uint32_t i = 0; i < code->pages; ++i) {
+            vmm_map(USER_BASE + PAGE_SIZE * i, (uint32_t) code->head + PAGE_SIZE * i, PTE_U | PTE_P);
 #if 0
-                        printf("[%p]> [%08X] %08X\n", (int*)pa + j, USER_BASE + PAGE_SIZE * i + j * 4, vmm_get<uint32_t>(USER_BASE + PAGE_SIZE * i + j * 4));
+            printf("CODE> [%08X] %p\n", USER_BASE + PAGE_SIZE * i, code->head + PAGE_SIZE * i);
 #endif
-                    }
-                }
-            }
         }
         /* 映射4KB的数据空间 */
         {
@@ -268,302 +684,1658 @@ namespace clib {
         }
         /* 映射4KB的栈空间 */
         vmm_map(STACK_BASE, (uint32_t) pmm_alloc(), PTE_U | PTE_P | PTE_R); // 用户栈空间
-        /* 映射16KB的堆空间 */
+        /* 映射堆空间 */
+        for (int i = 0; i < HEAP_SIZE; ++i) {
+            vmm_map(HEAP_BASE + PAGE_SIZE * i, (uint32_t) mem->heapHead + PAGE_SIZE * i, PTE_U | PTE_P | PTE_R);
+        }
+    }
+
+    std::unique_ptr<cvm> cvm::fork() {
+        std::lock_guard<std::recursive_mutex> guard(mm_lock);
+        std::unique_ptr<cvm> child(new cvm());
+        child->code = code;
+        child->refs = refs;
+        child->refs.push_back(mem); // 子虚拟机引用父虚拟机的页框
+        for (uint32_t i = 0; i < PDE_SIZE; i++) {
+            auto pte = (pte_t *) (pgdir[i] & PAGE_MASK);
+            if (!pte) {
+                continue;
+            }
+            auto table = (pte_t *) child->pmm_alloc(); // 页表不共享
+            for (uint32_t j = 0; j < PTE_SIZE; j++) {
+                if ((pte[j] & PTE_P) && (pte[j] & (PTE_R | PTE_COW))) {
+                    pte[j] = (pte[j] & ~PTE_R) | PTE_COW; // 父子双方均标记为写时复制
+                }
+                table[j] = pte[j];
+            }
+            child->pgdir[i] = (uint32_t) table | (pgdir[i] & ~PAGE_MASK);
+        }
+        child->heap_brk = heap_brk;
+        child->map_brk = map_brk; // 映射的文件由父虚拟机的页框持有
+        child->regs = regs;
+        child->tasks = tasks;
+        child->current = current;
+        child->state = state;
+        child->exit_code = exit_code;
+        child->output = output;
+        child->outbuf.resize(outbuf.size());
+        child->outline = outline;
         {
-            auto head = heap.alloc_array<byte>(PAGE_SIZE * (HEAP_SIZE + 2));
-#if 0
-            printf("HEAP> ALLOC=%p\n", head);
-#endif
-            heapHead = head; // 得到内存池起始地址
-            heap.free_array(heapHead);
-            heapHead = (byte *) PAGE_ALIGN_UP((uint32_t) head);
-#if 0
-            printf("HEAP> HEAD=%p\n", heapHead);
-#endif
-            memset(heapHead, 0, PAGE_SIZE * HEAP_SIZE);
-            for (int i = 0; i < HEAP_SIZE; ++i) {
-                vmm_map(HEAP_BASE + PAGE_SIZE * i, (uint32_t) heapHead + PAGE_SIZE * i, PTE_U | PTE_P | PTE_R);
+            std::lock_guard<std::mutex> files_guard(file_lock);
+            child->files = files;
+        }
+        child->chans = chans;
+        {
+            std::lock_guard<std::mutex> coll_guard(coll_lock);
+            coll_copy(child->maps, maps);
+            coll_copy(child->vecs, vecs);
+        }
+        return child;
+    }
+
+    // 快照文件头，之后依次为协程表、页面表，页面数据按页对齐存放
+    struct cvm_snap_header {
+        char magic[4];
+        uint32_t version;
+        cvm_ctx regs;
+        uint32_t heap_brk;
+        int current;
+        uint32_t tasks;
+        uint32_t pages;
+    };
+
+    // 快照中的页面
+    struct cvm_snap_page {
+        uint32_t va;
+        uint32_t flags;
+        uint32_t offset; // 页面数据在文件中的偏移，0为全零页
+    };
+
+#define SNAP_MAGIC "CMVS"
+#define SNAP_VERSION 1
+
+    static bool page_is_zero(const byte *page) {
+        for (uint32_t i = 0; i < PAGE_SIZE; i += sizeof(uint32_t)) {
+            if (*(const uint32_t *) (page + i) != 0)
+                return false;
+        }
+        return true;
+    }
+
+    int cvm::checkpoint(const char *path) {
+        {
+            std::lock_guard<std::mutex> guard(thread_lock);
+            for (auto &t : threads) {
+                if (t)
+                    return -1; // 线程的宿主状态无法保存
+            }
+        }
+        {
+            std::lock_guard<std::mutex> guard(io_lock);
+            for (auto &io : ios) {
+                if (io.used)
+                    return -1;
             }
         }
+        {
+            std::lock_guard<std::mutex> guard(coll_lock);
+            for (auto &m : maps) {
+                if (m)
+                    return -1; // 宿主容器不在虚拟机内存中
+            }
+            for (auto &v : vecs) {
+                if (v)
+                    return -1;
+            }
+        }
+        std::lock_guard<std::recursive_mutex> guard(mm_lock);
+        std::vector<cvm_snap_page> pages;
+        std::vector<const byte *> frames;
+        uint32_t offset = 0;
+        for (uint32_t i = PDE_INDEX(USER_BASE); i < PDE_SIZE; i++) {
+            auto pte = (pte_t *) (pgdir[i] & PAGE_MASK);
+            if (!pte) {
+                continue;
+            }
+            for (uint32_t j = 0; j < PTE_SIZE; j++) {
+                if (!(pte[j] & PTE_P)) {
+                    continue;
+                }
+                auto frame = (const byte *) (pte[j] & PAGE_MASK);
+                auto flags = pte[j] & ~PAGE_MASK;
+                if (flags & PTE_COW) {
+                    flags = (flags & ~PTE_COW) | PTE_R; // 恢复后页面独占
+                }
+                auto zero = page_is_zero(frame); // 全零页不写入文件，堆大部分为此类页面
+                pages.push_back({(i << 22) | (j << 12), flags, zero ? 0 : ++offset});
+                if (!zero)
+                    frames.push_back(frame);
+            }
+        }
+        cvm_snap_header hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+        hdr.version = SNAP_VERSION;
+        hdr.regs = regs;
+        hdr.heap_brk = heap_brk;
+        hdr.current = current;
+        hdr.tasks = (uint32_t) tasks.size();
+        hdr.pages = (uint32_t) pages.size();
+        auto meta = sizeof(hdr) + tasks.size() * sizeof(cvm_task) + pages.size() * sizeof(cvm_snap_page);
+        auto data = PAGE_ALIGN_UP((uint32_t) meta);
+        for (auto &page : pages) {
+            if (page.offset)
+                page.offset = data + (page.offset - 1) * PAGE_SIZE;
+        }
+        auto f = fopen(path, "wb");
+        if (!f) {
+            return -1;
+        }
+        auto ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+        ok = ok && (tasks.empty() || fwrite(tasks.data(), sizeof(cvm_task), tasks.size(), f) == tasks.size());
+        ok = ok && fwrite(pages.data(), sizeof(cvm_snap_page), pages.size(), f) == pages.size();
+        std::vector<byte> pad(data - meta);
+        ok = ok && (pad.empty() || fwrite(pad.data(), 1, pad.size(), f) == pad.size());
+        for (auto frame : frames) {
+            ok = ok && fwrite(frame, PAGE_SIZE, 1, f) == 1;
+        }
+        ok = fclose(f) == 0 && ok;
+        return ok ? 0 : -1;
+    }
+
+    std::unique_ptr<cvm> cvm::restore(const char *path) {
+        std::unique_ptr<cvm> vm(new cvm());
+        vm->mem->image.reset(new cmmap(path));
+        auto image = vm->mem->image->data();
+        auto size = vm->mem->image->size();
+        auto hdr = (const cvm_snap_header *) image;
+        if (!image || size < sizeof(*hdr) || memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) != 0 ||
+            hdr->version != SNAP_VERSION) {
+            printf("RESTORE> Invalid snapshot: %s\n", path);
+            throw std::exception();
+        }
+        auto tasks = (const cvm_task *) (hdr + 1);
+        auto pages = (const cvm_snap_page *) (tasks + hdr->tasks);
+        if ((const byte *) (pages + hdr->pages) > image + size) {
+            printf("RESTORE> Truncated snapshot: %s\n", path);
+            throw std::exception();
+        }
+        for (uint32_t i = 0; i < hdr->pages; i++) {
+            auto &page = pages[i];
+            uint32_t pa;
+            if (page.offset) {
+                if (page.offset + PAGE_SIZE > size) {
+                    printf("RESTORE> Truncated snapshot: %s\n", path);
+                    throw std::exception();
+                }
+                pa = (uint32_t) (image + page.offset); // 私有映射，写入时由宿主复制
+            } else if (page.va >= HEAP_BASE && page.va < MMAP_BASE) {
+                pa = (uint32_t) vm->mem->heapHead + (page.va - HEAP_BASE);
+            } else {
+                pa = vm->pmm_alloc();
+            }
+            vm->vmm_map(page.va, pa, page.flags);
+            if (page.va >= MMAP_BASE && page.va - MMAP_BASE + 2 * PAGE_SIZE > vm->map_brk)
+                vm->map_brk = page.va - MMAP_BASE + 2 * PAGE_SIZE; // 映射的文件已存入快照
+        }
+        vm->regs = hdr->regs;
+        vm->regs.ax = 1; // checkpoint()在恢复后返回1
+        vm->heap_brk = hdr->heap_brk;
+        vm->current = hdr->current;
+        vm->tasks.assign(tasks, tasks + hdr->tasks);
+        return vm;
     }
 
     cvm::~cvm() {
+        halt = true;
+        for (auto &th : threads) {
+            if (th && th->th.joinable())
+                th->th.join();
+        }
+        pool.reset();
+        {
+            // 排队中和阻塞中的请求不再访问本虚拟机，只等待正在读写本虚拟机内存的请求
+            std::unique_lock<std::mutex> lk(io_ctl->lock);
+            io_ctl->alive = false;
+            io_ctl->cv.wait(lk, [this]() { return io_ctl->running == 0; });
+        }
+        flush();
         free(pgd_kern);
-        free(pte_kern);
     }
 
-    void cvm::init_args(uint32_t *args, uint32_t sp, uint32_t pc, bool converted /*= false*/) {
-        auto num = vmm_get(pc + INC_PTR); /* 利用之后的ADJ清栈指令知道函数调用的参数个数 */
-        auto tmp = VMM_ARG(sp, num);
-        for (int k = 0; k < num; k++) {
-            auto arg = VMM_ARGS(tmp, k + 1);
-            if (converted && (arg & DATA_BASE))
-                args[k] = (uint32_t) vmm_getstr(arg);
-            else
-                args[k] = (uint32_t) arg;
+    cvm_call::cvm_call(cvm &vm, cvm_ctx &ctx, int argc, bool main, int &budget)
+            : vm(vm), ctx(ctx), n(argc), main(main), budget(budget) {
+        if (argc > 0) {
+            uint32_t size;
+            slots = (const uint32_t *) vm.vmm_page(ctx.sp, &size); // 参数都在同一个栈页中
+            if (size < argc * INC_PTR) {
+                printf("SYSCALL> Invalid stack: %08X\n", ctx.sp);
+                throw std::exception();
+            }
         }
     }
 
-    int cvm::exec(int entry) {
+    int cvm_call::argc() const {
+        return n;
+    }
+
+    const char *cvm_call::str(int i) const {
+        string_t buf;
+        uint32_t len;
+        auto p = vm.vmm_strref(arg(i), &len, buf);
+        if (p != buf.data())
+            return p;
+        strs.push_back(std::move(buf)); // 跨页时复制，保留到调用结束
+        return strs.back().c_str();
+    }
+
+    string_t cvm_call::string(int i) const {
+        auto va = arg(i);
+        string_t s(vm.vmm_strlen(va, UINT32_MAX), '\0');
+        vm.vmm_read(va, &s[0], (uint32_t) s.size());
+        return s;
+    }
+
+    uint32_t cvm_call::new_str(const char *s, uint32_t len) const {
+        auto va = vm.vmm_malloc(len + 1);
+        vm.vmm_write(va, s, len);
+        vm.vmm_set<char>(va + len, 0);
+        return va;
+    }
+
+    void cvm_call::read(uint32_t va, void *dst, uint32_t size) const {
+        vm.vmm_read(va, dst, size);
+    }
+
+    void cvm_call::write(uint32_t va, const void *src, uint32_t size) const {
+        vm.vmm_write(va, src, size);
+    }
+
+    uint32_t cvm_call::malloc(uint32_t size) const {
+        return vm.vmm_malloc(size);
+    }
+
+    void cvm_call::again() {
+        ctx.pc -= 2 * INC_PTR; // 回到SYSC
+        suspend = true;
+    }
+
+    // 系统调用表，只增不改，读时不加锁
+    struct cvm_syscalls {
+        cvm_syscall calls[SYSCALL_MAX];
+        std::atomic<int> count{0};
+        std::mutex lock;
+    };
+
+    static cvm_syscalls &syscall_table() {
+        static cvm_syscalls table;
+        return table;
+    }
+
+    static int syscall_add(const string_t &name, int arity, cvm_syscall_t fn) {
+        auto &table = syscall_table();
+        std::lock_guard<std::mutex> guard(table.lock);
+        auto n = table.count.load();
+        if (n >= SYSCALL_MAX)
+            return -1;
+        for (auto i = 0; i < n; ++i) {
+            if (table.calls[i].name == name)
+                return -1;
+        }
+        table.calls[n] = cvm_syscall{name, arity, std::move(fn)};
+        table.count.store(n + 1, std::memory_order_release);
+        return n;
+    }
+
+    static std::once_flag syscall_once;
+
+    int cvm::add_syscall(const string_t &name, int arity, cvm_syscall_t fn) {
+        std::call_once(syscall_once, builtin_syscalls);
+        return syscall_add(name, arity, std::move(fn));
+    }
+
+    int cvm::syscall_count() {
+        std::call_once(syscall_once, builtin_syscalls);
+        return syscall_table().count.load(std::memory_order_acquire);
+    }
+
+    const cvm_syscall *cvm::get_syscall(int id) {
+        std::call_once(syscall_once, builtin_syscalls);
+        auto &table = syscall_table();
+        if (id < 0 || id >= table.count.load(std::memory_order_acquire))
+            return nullptr;
+        return &table.calls[id];
+    }
+
+    void cvm::builtin_syscalls() {
+        syscall_add("printf", -1, [](cvm_call &c) {
+            auto num = c.argc(); // 参数个数不限
+            uint32_t small[16];
+            std::vector<uint32_t> more;
+            auto vargs = small;
+            if (num > 16) {
+                more.resize((size_t) num);
+                vargs = more.data();
+            }
+            for (auto k = 1; k < num; k++) {
+                vargs[k - 1] = c.arg(k);
+            }
+            return num > 0 ? c.vm.vm_printf(c.arg(0), vargs, num - 1) : 0;
+        });
+        syscall_add("memcmp", 3, [](cvm_call &c) {
+            return (int) c.vm.vmm_memcmp(c.arg(0), c.arg(1), c.arg(2));
+        });
+        syscall_add("memset", 3, [](cvm_call &c) {
+#if 0
+            printf("MEMSET> PTR=%08X SIZE=%08X VAL=%d\n", c.arg(0), c.arg(2), c.arg(1));
+#endif
+            return (int) c.vm.vmm_memset(c.arg(0), c.arg(1), c.arg(2));
+        });
+        syscall_add("open", 2, [](cvm_call &c) {
+#if 0
+            printf("OPEN> name=%s flags=%X\n", c.str(0), c.arg(1));
+#endif
+            return c.vm.file_open(c.str(0), (int) c.arg(1));
+        });
+        syscall_add("read", 3, [](cvm_call &c) {
+#if 0
+            printf("READ> buf=%08X size=%08X fd=%d\n", c.arg(1), c.arg(2), c.arg(0));
+#endif
+            return c.vm.file_read((int) c.arg(0), c.arg(1), c.arg(2));
+        });
+        // pread(fd, buf, n, lo, hi)，偏移为64位，占两个参数，低位在前（同printf的%lld）
+        syscall_add("pread", 5, [](cvm_call &c) {
+            auto offset = (int64_t) ((uint64_t) c.arg(4) << 32 | c.arg(3));
+            return c.vm.file_read((int) c.arg(0), c.arg(1), c.arg(2), true, offset);
+        });
+        syscall_add("write", 3, [](cvm_call &c) {
+            return c.vm.file_write((int) c.arg(0), c.arg(1), c.arg(2));
+        });
+        // seek(fd, pos, whence)，pos指向64位偏移（两个int，低位在前），成功时写回新位置并返回0，出错返回-1
+        syscall_add("seek", 3, [](cvm_call &c) {
+            auto f = c.vm.file_get((int) c.arg(0));
+            if (!f)
+                return -1;
+            uint32_t pos[2];
+            c.read(c.arg(1), pos, sizeof(pos));
+            auto offset = f->seek((int64_t) ((uint64_t) pos[1] << 32 | pos[0]), (int) c.arg(2));
+            if (offset < 0)
+                return -1;
+            pos[0] = (uint32_t) offset;
+            pos[1] = (uint32_t) ((uint64_t) offset >> 32);
+            c.write(c.arg(1), pos, sizeof(pos));
+            return 0;
+        });
+        syscall_add("mmap_file", 1, [](cvm_call &c) {
+            return (int) c.vm.vmm_mmap(c.str(0));
+        });
+        syscall_add("aread", 3, [](cvm_call &c) {
+            return c.vm.io_submit(false, (int) c.arg(0), c.arg(1), c.arg(2));
+        });
+        syscall_add("awrite", 3, [](cvm_call &c) {
+            return c.vm.io_submit(true, (int) c.arg(0), c.arg(1), c.arg(2));
+        });
+        syscall_add("await", 1, [](cvm_call &c) {
+            auto &vm = c.vm;
+            auto id = (int) c.arg(0);
+            int ret;
+            if (vm.io_result(id, &ret)) {
+                if (c.main)
+                    vm.tasks[vm.current].state = task_ready;
+                return ret;
+            }
+            c.again(); // 完成后重新执行await
+            if (!c.main) {
+                vm.io_wait(id);
+                return 0;
+            }
+            vm.tasks[vm.current].state = task_io;
+            vm.tasks[vm.current].join = id;
+            if (c.budget >= 0 && !vm.task_poll()) {
+                c.budget = 0; // 协程都在等待，交还宿主，稍后exec继续
+                return 0;
+            }
+            vm.task_switch();
+            return 0;
+        });
+        syscall_add("close", 1, [](cvm_call &c) {
+            return c.vm.file_close((int) c.arg(0));
+        });
+        syscall_add("malloc", 1, [](cvm_call &c) {
+            return (int) c.vm.vmm_malloc(c.arg(0));
+        });
+        syscall_add("trace", 1, [](cvm_call &c) {
+            int ret = c.ctx.log;
+            c.ctx.log = c.arg(0) != 0;
+            return ret;
+        });
+        syscall_add("trans", 1, [](cvm_call &c) {
+            return (int) (uint32_t) c.vm.vmm_getstr(c.arg(0)); // 宿主地址
+        });
+        syscall_add("spawn", 2, [](cvm_call &c) {
+            return c.main ? c.vm.task_spawn(c.arg(0), c.arg(1)) : -1;
+        });
+        syscall_add("yield", 0, [](cvm_call &c) {
+            c.ctx.ax = 0;
+            if (c.main) {
+                c.suspend = true; // 切换后ctx为其他协程的寄存器
+                c.vm.task_switch();
+            } else {
+                std::this_thread::yield();
+            }
+            return 0;
+        });
+        syscall_add("join", 1, [](cvm_call &c) {
+            auto &vm = c.vm;
+            auto &tasks = vm.tasks;
+            auto id = (int) c.arg(0);
+            if (!c.main || id <= 0 || id >= (int) tasks.size() || id == vm.current || tasks[id].state == task_free) {
+                return -1;
+            }
+            if (tasks[id].state == task_dead) {
+                tasks[id].state = task_free; // 回收
+                return tasks[id].ctx.ax;
+            }
+            c.again(); // 唤醒后重新执行join
+            tasks[vm.current].state = task_join;
+            tasks[vm.current].join = id;
+            vm.task_switch();
+            return 0;
+        });
+        syscall_add("clock", 0, [](cvm_call &c) {
+            return (int) std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+        });
+        syscall_add("thread_create", 2, [](cvm_call &c) {
+            return c.vm.thread_create(c.arg(0), c.arg(1));
+        });
+        syscall_add("thread_join", 1, [](cvm_call &c) {
+            return c.vm.thread_join((int) c.arg(0));
+        });
+        syscall_add("atomic_add", 2, [](cvm_call &c) {
+            return c.vm.vmm_atomic(c.arg(0))->fetch_add((int) c.arg(1));
+        });
+        syscall_add("atomic_cas", 3, [](cvm_call &c) {
+            auto expected = (int) c.arg(1);
+            return c.vm.vmm_atomic(c.arg(0))->compare_exchange_strong(expected, (int) c.arg(2)) ? 1 : 0;
+        });
+        syscall_add("parallel_for", 4, [](cvm_call &c) {
+            if (c.ctx.stack >= worker_stack(0)) // 不支持嵌套
+                return -1;
+            return c.vm.parallel_for((int) c.arg(0), (int) c.arg(1), c.arg(2), c.arg(3));
+        });
+        syscall_add("chan_send", 3, [](cvm_call &c) {
+            auto &vm = c.vm;
+            auto chan = vm.chans->get((int) c.arg(0));
+            auto buf = c.arg(1), len = c.arg(2);
+            if (!vm.vmm_isspan(buf, len)) {
+                printf("chan_send: invalid buffer %08X\n", buf);
+                throw std::exception();
+            }
+            if (chan->is_closed())
+                return -1;
+            if (chan->try_send(len, [&](byte *dst) { vm.vmm_read(buf, dst, len); }))
+                return (int) len;
+            // 通道满，切换到其他协程或让出宿主线程，稍后重新执行
+            c.again();
+            if (c.main && vm.tasks.size() > 1)
+                vm.task_switch();
+            else
+                std::this_thread::yield();
+            return 0;
+        });
+        syscall_add("chan_recv", 3, [](cvm_call &c) {
+            auto &vm = c.vm;
+            auto chan = vm.chans->get((int) c.arg(0));
+            auto buf = c.arg(1), max = c.arg(2);
+            if (!vm.vmm_iswspan(buf, max)) { // 取出消息后不能再失败
+                printf("chan_recv: invalid buffer %08X\n", buf);
+                throw std::exception();
+            }
+            int ret = -1;
+            auto recv = [&](const byte *src, uint32_t len) {
+                ret = (int) (len < max ? len : max); // 超出缓冲的部分被截断
+                vm.vmm_write(buf, src, (uint32_t) ret);
+            };
+            if (chan->try_recv(recv))
+                return ret;
+            if (chan->is_closed()) { // 关闭前发出的消息仍可收到
+                chan->try_recv(recv);
+                return ret;
+            }
+            // 通道空，切换到其他协程或让出宿主线程，稍后重新执行
+            c.again();
+            if (c.main && vm.tasks.size() > 1)
+                vm.task_switch();
+            else
+                std::this_thread::yield();
+            return 0;
+        });
+        syscall_add("chan_close", 1, [](cvm_call &c) {
+            c.vm.chans->get((int) c.arg(0))->close();
+            return 0;
+        });
+        syscall_add("checkpoint", 1, [](cvm_call &c) {
+            return c.main && c.vm.current == 0 ? c.vm.checkpoint(c.str(0)) : -1;
+        });
+        syscall_add("strlen", 1, [](cvm_call &c) {
+            return (int) c.vm.vmm_strlen(c.arg(0), UINT32_MAX);
+        });
+        syscall_add("strcmp", 2, [](cvm_call &c) {
+            return c.vm.vmm_strcmp(c.arg(0), c.arg(1));
+        });
+        syscall_add("strchr", 2, [](cvm_call &c) {
+            return (int) c.vm.vmm_strchr(c.arg(0), (char) c.arg(1));
+        });
+        syscall_add("strcpy", 2, [](cvm_call &c) {
+            return (int) c.vm.vmm_strcpy(c.arg(0), c.arg(1));
+        });
+        syscall_add("memchr", 3, [](cvm_call &c) {
+            return (int) c.vm.vmm_memchr(c.arg(0), (char) c.arg(1), c.arg(2));
+        });
+        syscall_add("sort_int", 2, [](cvm_call &c) {
+            c.vm.vmm_inplace<int>(c.arg(0), c.arg(1), [](int *begin, int *end) { std::sort(begin, end); });
+            return 0;
+        });
+        syscall_add("sort_bytes", 2, [](cvm_call &c) {
+            c.vm.vmm_inplace<byte>(c.arg(0), c.arg(1), [](byte *begin, byte *end) {
+                uint32_t count[256] = {0}; // 计数排序，按无符号比较
+                for (auto p = begin; p != end; ++p)
+                    count[*p]++;
+                for (auto i = 0; i < 256; ++i) {
+                    memset(begin, i, count[i]);
+                    begin += count[i];
+                }
+            });
+            return 0;
+        });
+        // qsort(base, n, size, cmp)，cmp(a, b)为虚拟机中的函数，返回调用cmp的次数
+        syscall_add("qsort", 4, [](cvm_call &c) {
+            auto &vm = c.vm;
+            auto base = c.arg(0), n = c.arg(1), size = c.arg(2), cmp = c.arg(3);
+            if (n < 2 || size == 0)
+                return 0;
+            vm.vmm_checkarray(base, n, size, "QSORT");
+            std::vector<uint32_t> order(n);
+            for (uint32_t i = 0; i < n; ++i)
+                order[i] = i;
+            auto calls = 0;
+            // 元素排序前不移动，比较时传入原地址；归并排序在比较函数不一致时也不会越界
+            std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+                calls++;
+                return vm.vm_call(c.ctx, cmp, {base + a * size, base + b * size}) < 0;
+            });
+            std::vector<byte> from(n * size), to(n * size);
+            vm.vmm_read(base, from.data(), n * size);
+            for (uint32_t i = 0; i < n; ++i)
+                memcpy(to.data() + i * size, from.data() + order[i] * size, size);
+            vm.vmm_write(base, to.data(), n * size);
+            return calls;
+        });
+        // bsearch(key, base, n, size, cmp)，返回找到的元素地址，没有时返回0
+        syscall_add("bsearch", 5, [](cvm_call &c) {
+            auto &vm = c.vm;
+            auto key = c.arg(0), base = c.arg(1), size = c.arg(3), cmp = c.arg(4);
+            uint32_t lo = 0, hi = c.arg(2);
+            if (size == 0)
+                return 0;
+            vm.vmm_checkarray(base, hi, size, "BSEARCH");
+            while (lo < hi) {
+                auto mid = lo + (hi - lo) / 2;
+                auto r = vm.vm_call(c.ctx, cmp, {key, base + mid * size});
+                if (r == 0)
+                    return (int) (base + mid * size);
+                if (r < 0)
+                    hi = mid;
+                else
+                    lo = mid + 1;
+            }
+            return 0;
+        });
+        // map_new(strkey)，strkey非0时键为字符串（按内容比较），否则为整数，返回句柄
+        syscall_add("map_new", 1, [](cvm_call &c) {
+            std::lock_guard<std::mutex> guard(c.vm.coll_lock);
+            return coll_add(c.vm.maps, new chash(c.arg(0) != 0));
+        });
+        // map_get(m, key, def)，没有时返回def
+        syscall_add("map_get", 3, [](cvm_call &c) {
+            auto &vm = c.vm;
+            std::lock_guard<std::mutex> guard(vm.coll_lock);
+            auto &m = vm.coll_map((int) c.arg(0), "map_get");
+            auto val = (int) c.arg(2);
+            if (m.is_strkey()) {
+                string_t buf;
+                uint32_t len;
+                auto key = vm.vmm_strref(c.arg(1), &len, buf);
+                m.get(key, len, &val);
+            } else {
+                m.get((int) c.arg(1), &val);
+            }
+            return val;
+        });
+        // map_put(m, key, val)，新插入时返回1，更新时返回0
+        syscall_add("map_put", 3, [](cvm_call &c) {
+            auto &vm = c.vm;
+            std::lock_guard<std::mutex> guard(vm.coll_lock);
+            auto &m = vm.coll_map((int) c.arg(0), "map_put");
+            if (m.is_strkey()) {
+                string_t buf;
+                uint32_t len;
+                auto key = vm.vmm_strref(c.arg(1), &len, buf);
+                return m.put(key, len, (int) c.arg(2)) ? 1 : 0;
+            }
+            return m.put((int) c.arg(1), (int) c.arg(2)) ? 1 : 0;
+        });
+        // map_del(m, key)，删除时返回1，没有时返回0
+        syscall_add("map_del", 2, [](cvm_call &c) {
+            auto &vm = c.vm;
+            std::lock_guard<std::mutex> guard(vm.coll_lock);
+            auto &m = vm.coll_map((int) c.arg(0), "map_del");
+            if (m.is_strkey()) {
+                string_t buf;
+                uint32_t len;
+                auto key = vm.vmm_strref(c.arg(1), &len, buf);
+                return m.del(key, len) ? 1 : 0;
+            }
+            return m.del((int) c.arg(1)) ? 1 : 0;
+        });
+        syscall_add("map_len", 1, [](cvm_call &c) {
+            std::lock_guard<std::mutex> guard(c.vm.coll_lock);
+            return (int) c.vm.coll_map((int) c.arg(0), "map_len").size();
+        });
+        syscall_add("map_free", 1, [](cvm_call &c) {
+            std::lock_guard<std::mutex> guard(c.vm.coll_lock);
+            return coll_free(c.vm.maps, (int) c.arg(0));
+        });
+        syscall_add("vec_new", 0, [](cvm_call &c) {
+            std::lock_guard<std::mutex> guard(c.vm.coll_lock);
+            return coll_add(c.vm.vecs, new std::vector<int>());
+        });
+        // vec_push(v, x)，返回x的下标
+        syscall_add("vec_push", 2, [](cvm_call &c) {
+            std::lock_guard<std::mutex> guard(c.vm.coll_lock);
+            auto &v = c.vm.coll_vec((int) c.arg(0), "vec_push");
+            v.push_back((int) c.arg(1));
+            return (int) v.size() - 1;
+        });
+        syscall_add("vec_get", 2, [](cvm_call &c) {
+            std::lock_guard<std::mutex> guard(c.vm.coll_lock);
+            auto &v = c.vm.coll_vec((int) c.arg(0), "vec_get");
+            auto i = c.arg(1);
+            if (i >= v.size()) {
+                printf("vec_get: index %d out of range %d\n", (int) i, (int) v.size());
+                throw std::exception();
+            }
+            return v[i];
+        });
+        syscall_add("vec_set", 3, [](cvm_call &c) {
+            std::lock_guard<std::mutex> guard(c.vm.coll_lock);
+            auto &v = c.vm.coll_vec((int) c.arg(0), "vec_set");
+            auto i = c.arg(1);
+            if (i >= v.size()) {
+                printf("vec_set: index %d out of range %d\n", (int) i, (int) v.size());
+                throw std::exception();
+            }
+            v[i] = (int) c.arg(2);
+            return 0;
+        });
+        syscall_add("vec_len", 1, [](cvm_call &c) {
+            std::lock_guard<std::mutex> guard(c.vm.coll_lock);
+            return (int) c.vm.coll_vec((int) c.arg(0), "vec_len").size();
+        });
+        syscall_add("vec_free", 1, [](cvm_call &c) {
+            std::lock_guard<std::mutex> guard(c.vm.coll_lock);
+            return coll_free(c.vm.vecs, (int) c.arg(0));
+        });
+    }
+
+    void cvm::init(int entry, int argc, char **argv) {
         auto poolsize = PAGE_SIZE;
         auto stack = STACK_BASE;
-        auto data = DATA_BASE;
-        auto base = USER_BASE;
 
-        auto sp = stack + poolsize; // 4KB / sizeof(int) = 1024
+        // 上次运行退出后剩下的线程已收到halt，等其结束后才能清除halt，线程栈保留给之后的线程
+        {
+            std::lock_guard<std::mutex> guard(thread_lock);
+            for (auto &th : threads) {
+                if (th && th->th.joinable())
+                    th->th.join();
+                th.reset();
+            }
+        }
+        halt = false;
+        heap_brk = 0; // 参数从堆底重新分配
+
+        regs = cvm_ctx();
+        regs.stack = stack + poolsize;
+        regs.sp = regs.stack; // 4KB / sizeof(int) = 1024
 
         {
-            auto argvs = vmm_malloc(g_argc * INC_PTR);
-            for (auto i = 0; i < g_argc; i++) {
+            auto argvs = vmm_malloc(argc * INC_PTR);
+            for (auto i = 0; i < argc; i++) {
                 auto str = vmm_malloc(256);
-                vmm_setstr(str, g_argv[i]);
+                vmm_setstr(str, argv[i]);
                 vmm_set(argvs + INC_PTR * i, str);
             }
 
-            vmm_pushstack(sp, EXIT);
-            vmm_pushstack(sp, PUSH);
-            auto tmp = sp;
-            vmm_pushstack(sp, g_argc);
-            vmm_pushstack(sp, argvs);
-            vmm_pushstack(sp, tmp);
+            vmm_pushstack(regs.sp, EXIT);
+            vmm_pushstack(regs.sp, PUSH);
+            auto tmp = regs.sp;
+            vmm_pushstack(regs.sp, argc);
+            vmm_pushstack(regs.sp, argvs);
+            vmm_pushstack(regs.sp, tmp);
+        }
+
+        regs.pc = USER_BASE + entry * INC_PTR;
+        state = vm_ready;
+        exit_code = 0;
+
+        tasks.resize(1);
+        tasks[0].state = task_ready;
+        current = 0;
+    }
+
+    void cvm::init_call(cvm_ctx &ctx, uint32_t stack, uint32_t func, std::initializer_list<uint32_t> args) {
+        ctx = cvm_ctx();
+        ctx.stack = stack;
+        ctx.sp = stack;
+        vmm_pushstack(ctx.sp, EXIT); // 函数返回后执行PUSH、EXIT，结束协程或线程
+        vmm_pushstack(ctx.sp, PUSH);
+        auto tmp = ctx.sp;
+        for (auto arg : args) {
+            vmm_pushstack(ctx.sp, arg);
+        }
+        vmm_pushstack(ctx.sp, tmp);
+        ctx.pc = USER_BASE + func * INC_PTR;
+    }
+
+    int cvm::vm_call(const cvm_ctx &ctx, uint32_t func, std::initializer_list<uint32_t> args) {
+        cvm_ctx sub;
+        init_call(sub, ctx.sp, func, args); // 不是主线程的寄存器，EXIT时返回
+        sub.log = ctx.log;
+        run(sub, -1);
+        return sub.ax;
+    }
+
+    uint32_t cvm::task_stack(int id) {
+        return STACK_BASE + 2 * id * PAGE_SIZE + PAGE_SIZE;
+    }
+
+    int cvm::task_spawn(uint32_t func, uint32_t arg) {
+        auto id = 1;
+        for (; id < (int) tasks.size(); ++id) {
+            if (tasks[id].state == task_free)
+                break;
+        }
+        if (id == (int) tasks.size()) {
+            if (id >= TASK_MAX)
+                return -1;
+            tasks.emplace_back();
+            vmm_map(task_stack(id) - PAGE_SIZE, pmm_alloc(), PTE_U | PTE_P | PTE_R); // 协程栈空间
+        }
+        auto &task = tasks[id];
+        init_call(task.ctx, task_stack(id), func, {arg});
+        task.state = task_ready;
+        task.join = -1;
+        return id;
+    }
+
+    void cvm::task_exit() {
+        tasks[current].state = task_dead;
+        for (auto &task : tasks) {
+            if (task.state == task_join && task.join == current) {
+                task.state = task_ready; // 唤醒等待者
+                task.join = -1;
+            }
+        }
+        task_switch();
+    }
+
+    void cvm::task_switch() {
+        tasks[current].ctx = regs;
+        auto n = (int) tasks.size();
+        while (true) {
+            task_poll();
+            auto waiting = false;
+            for (auto i = 1; i <= n; ++i) {
+                auto id = (current + i) % n;
+                if (tasks[id].state == task_ready) {
+                    current = id;
+                    regs = tasks[id].ctx;
+                    return;
+                }
+                if (tasks[id].state == task_io)
+                    waiting = true;
+            }
+            if (!waiting)
+                break;
+            io_wait_any(); // 都在等待异步读写，阻塞至其一完成
+        }
+        printf("deadlock\n");
+        throw std::exception();
+    }
+
+    bool cvm::task_poll() {
+        std::lock_guard<std::mutex> guard(io_lock);
+        auto ready = false;
+        for (auto &task : tasks) {
+            if (task.state == task_io && io_done(task.join))
+                task.state = task_ready;
+            if (task.state == task_ready)
+                ready = true;
+        }
+        return ready;
+    }
+
+    uint32_t cvm::thread_stack(int id) {
+        return task_stack(TASK_MAX + id); // 线程栈排在协程栈之后
+    }
+
+    int cvm::thread_create(uint32_t func, uint32_t arg) {
+        std::lock_guard<std::mutex> guard(thread_lock);
+        auto id = 0;
+        for (; id < (int) threads.size(); ++id) {
+            if (!threads[id])
+                break;
+        }
+        if (id == (int) threads.size()) {
+            if (id >= THREAD_MAX)
+                return -1;
+            threads.emplace_back();
+            vmm_map(thread_stack(id) - PAGE_SIZE, pmm_alloc(), PTE_U | PTE_P | PTE_R); // 线程栈空间
+        }
+        auto th = new cvm_thread;
+        threads[id].reset(th);
+        init_call(th->ctx, thread_stack(id), func, {arg});
+        th->th = std::thread([this, th]() {
+            try {
+                while (!halt && run(th->ctx, THREAD_SLICE) == vm_yield); // 分片运行，便于主线程退出时停止
+            } catch (const std::exception &) {
+                printf("thread aborted\n");
+                th->ctx.ax = -1;
+            }
+        });
+        return id;
+    }
+
+    int cvm::thread_join(int id) {
+        cvm_thread *th;
+        {
+            std::lock_guard<std::mutex> guard(thread_lock);
+            if (id < 0 || id >= (int) threads.size() || !threads[id] || threads[id]->joining)
+                return -1;
+            th = threads[id].get();
+            th->joining = true;
+        }
+        th->th.join();
+        auto ret = th->ctx.ax;
+        std::lock_guard<std::mutex> guard(thread_lock);
+        threads[id].reset(); // 回收
+        return ret;
+    }
+
+    uint32_t cvm::worker_stack(int id) {
+        return task_stack(TASK_MAX + THREAD_MAX + id); // 线程池栈排在线程栈之后
+    }
+
+    int cvm::parallel_for(int lo, int hi, uint32_t func, uint32_t arg) {
+        {
+            std::lock_guard<std::mutex> guard(thread_lock);
+            if (!pool) {
+                auto n = (int) std::thread::hardware_concurrency();
+                n = n < 1 ? 1 : (n > WORKER_MAX ? WORKER_MAX : n);
+                for (auto i = 0; i < n; ++i) {
+                    vmm_map(worker_stack(i) - PAGE_SIZE, pmm_alloc(), PTE_U | PTE_P | PTE_R); // 线程池栈空间
+                }
+                pool.reset(new cpool(n));
+            }
+        }
+        std::atomic<bool> failed{false};
+        pool->run(lo, hi, [&](int worker, int l, int h) {
+            cvm_ctx ctx;
+            for (auto i = l; i < h && !halt; ++i) {
+                init_call(ctx, worker_stack(worker), func, {(uint32_t) i, arg});
+                try {
+                    while (!halt && run(ctx, THREAD_SLICE) == vm_yield);
+                } catch (const std::exception &) {
+                    failed = true;
+                }
+            }
+        });
+        return failed ? -1 : 0;
+    }
+
+    cvm_state_t cvm::get_state() const {
+        return state;
+    }
+
+    int cvm::get_exit_code() const {
+        return exit_code;
+    }
+
+    ulong cvm::get_cycle() const {
+        return cycle;
+    }
+
+    void cvm::set_output(cvm_output out, uint32_t size, cvm_flush_t policy) {
+        std::lock_guard<std::mutex> guard(out_lock);
+        flush_locked();
+        if (policy == flush_auto)
+            policy = !out && isatty(fileno(stdout)) ? flush_line : flush_full;
+        output = std::move(out);
+        outbuf.resize(size);
+        outline = policy == flush_line;
+    }
+
+    void cvm::flush() {
+        std::lock_guard<std::mutex> guard(out_lock);
+        flush_locked();
+    }
+
+    void cvm::set_chans(std::shared_ptr<cchan_set> set) {
+        chans = std::move(set);
+    }
+
+    void cvm::flush_locked() {
+        if (outlen == 0)
+            return;
+        if (output) {
+            output(outbuf.data(), outlen);
+        } else {
+            fwrite(outbuf.data(), 1, outlen, stdout);
+            fflush(stdout);
+        }
+        outlen = 0;
+    }
+
+    cvm_output cvm::file_output(FILE *f) {
+        return [f](const char *buf, size_t len) { fwrite(buf, 1, len, f); };
+    }
+
+    int cvm::print(const char *fmt, ...) {
+        std::lock_guard<std::mutex> guard(out_lock);
+        va_list ap;
+        int n;
+        // 直接格式化到缓冲区尾部，放不下时先刷新再重试
+        for (auto retry = 0; retry < 2; retry++) {
+            auto avail = (uint32_t) outbuf.size() - outlen;
+            va_start(ap, fmt);
+            n = vsnprintf(outbuf.data() + outlen, avail, fmt, ap);
+            va_end(ap);
+            if (n < 0)
+                return n;
+            if ((uint32_t) n < avail) {
+                auto line = outline && memchr(outbuf.data() + outlen, '\n', (size_t) n);
+                outlen += n;
+                if (line || outbuf.empty())
+                    flush_locked();
+                return n;
+            }
+            if (outlen == 0)
+                break;
+            flush_locked();
+        }
+        // 比整个缓冲区还长（或不缓冲），单独格式化后直接输出
+        std::vector<char> big((size_t) n + 1);
+        va_start(ap, fmt);
+        vsnprintf(big.data(), big.size(), fmt, ap);
+        va_end(ap);
+        if (output)
+            output(big.data(), (size_t) n);
+        else
+            fwrite(big.data(), 1, (size_t) n, stdout);
+        return n;
+    }
+
+    void cvm::out_write(const char *p, uint32_t n) {
+        if (outbuf.empty()) { // 不缓冲
+            if (output)
+                output(p, n);
+            else
+                fwrite(p, 1, n, stdout);
+            return;
+        }
+        while (n > 0) {
+            auto avail = (uint32_t) outbuf.size() - outlen;
+            if (avail == 0) {
+                flush_locked();
+                continue;
+            }
+            auto k = n < avail ? n : avail;
+            memcpy(outbuf.data() + outlen, p, k);
+            outlen += k;
+            p += k;
+            n -= k;
+        }
+    }
+
+    const char *cvm::vmm_page(uint32_t va, uint32_t *n) const {
+        uint32_t pa;
+        if (!vmm_ismap(va, &pa)) {
+            printf("VMMSTR> Invalid VA: %08X\n", va);
+            throw std::exception();
+        }
+        *n = PAGE_SIZE - OFFSET_INDEX(va);
+        return (const char *) pa + OFFSET_INDEX(va);
+    }
+
+    uint32_t cvm::out_str(uint32_t va, uint32_t max, bool *nl) {
+        uint32_t total = 0;
+        while (total < max) {
+            uint32_t n;
+            auto p = vmm_page(va, &n); // 逐页直接拷入输出缓冲区
+            if (n > max - total)
+                n = max - total;
+            auto end = (const char *) memchr(p, 0, n);
+            auto k = end ? (uint32_t) (end - p) : n;
+            if (nl && !*nl && memchr(p, '\n', k))
+                *nl = true;
+            out_write(p, k);
+            total += k;
+            va += k;
+            if (end)
+                break;
+        }
+        return total;
+    }
+
+    uint32_t cvm::vmm_strlen(uint32_t va, uint32_t max) const {
+        uint32_t total = 0;
+        while (total < max) {
+            uint32_t n;
+            auto p = vmm_page(va, &n);
+            if (n > max - total)
+                n = max - total;
+            auto end = (const char *) memchr(p, 0, n);
+            if (end)
+                return total + (uint32_t) (end - p);
+            total += n;
+            va += n;
+        }
+        return total;
+    }
+
+    int cvm::vmm_strcmp(uint32_t a, uint32_t b) const {
+        while (true) {
+            uint32_t na, nb;
+            auto pa = vmm_page(a, &na);
+            auto pb = vmm_page(b, &nb);
+            auto n = na < nb ? na : nb; // 两边都不跨页的部分
+            auto k = str_diff(pa, pb, n);
+            if (k < n)
+                return (int) (byte) pa[k] - (int) (byte) pb[k];
+            a += n;
+            b += n;
+        }
+    }
+
+    uint32_t cvm::vmm_strchr(uint32_t va, char c) const {
+        while (true) {
+            uint32_t n;
+            auto p = vmm_page(va, &n);
+            auto k = str_find(p, n, c);
+            if (k < n)
+                return p[k] == c ? va + k : 0;
+            va += n;
+        }
+    }
+
+    uint32_t cvm::vmm_memchr(uint32_t va, char c, uint32_t size) const {
+        while (size > 0) {
+            uint32_t n;
+            auto p = vmm_page(va, &n);
+            if (n > size)
+                n = size;
+            auto found = (const char *) memchr(p, c, n);
+            if (found)
+                return va + (uint32_t) (found - p);
+            va += n;
+            size -= n;
+        }
+        return 0;
+    }
+
+    uint32_t cvm::vmm_strcpy(uint32_t dst, uint32_t src) {
+        auto va = dst;
+        while (true) {
+            uint32_t n;
+            auto p = vmm_page(src, &n);
+            auto m = PAGE_SIZE - OFFSET_INDEX(va); // 目标页剩余
+            if (n > m)
+                n = m;
+            auto end = (const char *) memchr(p, 0, n);
+            auto k = end ? (uint32_t) (end - p) + 1 : n;
+            auto q = vmm_wptr(va);
+            if (!q) {
+                printf("STRCPY> Invalid VA: %08X\n", va);
+                throw std::exception();
+            }
+            memmove(q, p, k);
+            if (end)
+                return dst;
+            src += k;
+            va += k;
+        }
+    }
+
+    const char *cvm::vmm_strref(uint32_t va, uint32_t *len, string_t &buf) {
+        uint32_t n;
+        auto p = vmm_page(va, &n);
+        *len = vmm_strlen(va, UINT32_MAX);
+        if (*len < n)
+            return p;
+        buf.resize(*len);
+        vmm_read(va, &buf[0], *len);
+        return buf.data();
+    }
+
+    void cvm::vmm_checkarray(uint32_t va, uint32_t n, uint32_t size, const char *fn) const {
+        if (n == 0)
+            return;
+        if (n > UINT32_MAX / size || n * size > 0u - va) { // 大小或末地址溢出
+            printf("%s> Invalid array: %08X, %u * %u\n", fn, va, n, size);
+            throw std::exception();
+        }
+        if (!vmm_isspan(va, n * size)) {
+            printf("%s> Invalid VA: %08X\n", fn, va);
+            throw std::exception();
+        }
+    }
+
+    byte *cvm::vmm_span(uint32_t va, uint32_t size) const {
+        if (size == 0)
+            return nullptr;
+        auto pte = vmm_pte(va);
+        if (!pte || !(*pte & PTE_R))
+            return nullptr;
+        auto base = (*pte & PAGE_MASK) - PAGE_ALIGN_DOWN(va); // 宿主地址与虚拟地址之差
+        for (auto page = PAGE_ALIGN_DOWN(va) + PAGE_SIZE; page - va < size; page += PAGE_SIZE) {
+            pte = vmm_pte(page);
+            if (!pte || !(*pte & PTE_R) || (*pte & PAGE_MASK) - page != base) // 堆未经写时复制时连续
+                return nullptr;
         }
+        return (byte *) (base + va);
+    }
 
-        auto pc = USER_BASE + entry * INC_PTR;
-        auto ax = 0;
-        auto bp = 0;
-        auto log = false;
+    template<class T, class F>
+    void cvm::vmm_inplace(uint32_t va, uint32_t n, F f) {
+        vmm_checkarray(va, n, (uint32_t) sizeof(T), "INPLACE");
+        auto size = n * (uint32_t) sizeof(T);
+        auto p = (T *) vmm_span(va, size);
+        if (p) {
+            f(p, p + n);
+            return;
+        }
+        std::vector<T> tmp(n);
+        vmm_read(va, tmp.data(), size);
+        f(tmp.data(), tmp.data() + n);
+        vmm_write(va, tmp.data(), size);
+    }
+
+    int cvm::vm_printf(uint32_t fmt, const uint32_t *args, int argc) {
+        std::lock_guard<std::mutex> guard(out_lock);
+        auto next = 0;
+        auto arg = [&]() -> uint32_t { return next < argc ? args[next++] : 0; };
+        auto arg64 = [&]() -> uint64_t { // 64位操作数占两个参数，低位在前
+            uint64_t lo = arg();
+            return lo | ((uint64_t) arg() << 32);
+        };
+        auto line = false; // 按行刷新时，是否输出了换行
+        auto emit = [&](const char *p, uint32_t n) {
+            if (outline && !line && memchr(p, '\n', n))
+                line = true;
+            out_write(p, n);
+        };
+        auto pad = [&](int n) {
+            for (; n > 0; n--)
+                out_write(" ", 1);
+        };
+        auto total = 0;
+        auto va = fmt;
+        const char *cur = nullptr, *end = nullptr; // 格式串当前页中va对应的位置及页尾
+        auto getc = [&]() -> char {
+            if (cur == end) {
+                uint32_t n;
+                cur = vmm_page(va, &n);
+                end = cur + n;
+            }
+            va++;
+            return *cur++;
+        };
+        for (;;) {
+            // 普通字符直接从页面拷入输出缓冲区
+            if (cur == end) {
+                uint32_t n;
+                cur = vmm_page(va, &n);
+                end = cur + n;
+            }
+            auto k = cur;
+            while (k < end && *k && *k != '%')
+                k++;
+            emit(cur, (uint32_t) (k - cur));
+            total += (int) (k - cur);
+            va += (uint32_t) (k - cur);
+            cur = k;
+            if (k == end)
+                continue;
+            if (*k == 0)
+                break;
+            // 格式说明：%[flags][width][.precision][length]conversion
+            char spec[32];
+            auto len = 0;
+            spec[len++] = '%';
+            getc();
+            auto c = getc();
+            while (c && strchr("-+ #0", c)) {
+                if (len < 8)
+                    spec[len++] = c;
+                c = getc();
+            }
+            auto left = memchr(spec, '-', (size_t) len) != nullptr;
+            auto width = 0;
+            if (c == '*') {
+                width = (int) arg();
+                if (width < 0) {
+                    left = true;
+                    spec[len++] = '-';
+                    width = -width;
+                }
+                c = getc();
+            } else {
+                while (c >= '0' && c <= '9') {
+                    width = width * 10 + (c - '0');
+                    c = getc();
+                }
+            }
+            auto prec = -1;
+            if (c == '.') {
+                prec = 0;
+                c = getc();
+                if (c == '*') {
+                    prec = (int) arg();
+                    c = getc();
+                } else {
+                    while (c >= '0' && c <= '9') {
+                        prec = prec * 10 + (c - '0');
+                        c = getc();
+                    }
+                }
+            }
+            if (width > 4096)
+                width = 4096;
+            if (prec > 4096)
+                prec = 4096;
+            auto longs = 0;
+            while (c && strchr("hlLqjzt", c)) {
+                if (c == 'l' || c == 'L' || c == 'q')
+                    longs += c == 'l' ? 1 : 2;
+                c = getc();
+            }
+            if (c == 0) // 格式串在说明中间结束
+                break;
+            if (c == '%') {
+                out_write("%", 1);
+                total++;
+                continue;
+            }
+            if (c == 's') {
+                // 字符串逐页直接拷入输出缓冲区，不经过宿主字符串
+                static const char null_str[] = "(null)";
+                auto str = arg();
+                auto max = prec >= 0 ? (uint32_t) prec : UINT32_MAX;
+                auto m = !str ? (int) std::min((uint32_t) sizeof(null_str) - 1, max) :
+                         width > 0 ? (int) vmm_strlen(str, max) : 0;
+                if (!left)
+                    pad(width - m);
+                if (!str) {
+                    out_write(null_str, (uint32_t) m);
+                } else {
+                    m = (int) out_str(str, max, outline && !line ? &line : nullptr);
+                }
+                if (left)
+                    pad(width - m);
+                total += m > width ? m : width;
+                continue;
+            }
+            // 数值交给宿主格式化单个操作数
+            uint64_t v = 0;
+            switch (c) {
+                case 'd':
+                case 'i':
+                case 'u':
+                case 'x':
+                case 'X':
+                case 'o':
+                    v = longs >= 2 ? arg64() : arg();
+                    break;
+                case 'c':
+                case 'p':
+                    v = arg();
+                    break;
+                case 'f':
+                case 'F':
+                case 'e':
+                case 'E':
+                case 'g':
+                case 'G':
+                case 'a':
+                case 'A':
+                    v = longs > 0 ? arg64() : arg(); // double占两个参数，float占一个
+                    break;
+                default:
+                    break;
+            }
+            if (len == 1 && width == 0 && prec < 0 && (c == 'd' || c == 'u' || c == 'x') && longs < 2) {
+                // 最常见的%d、%u、%x直接转换
+                char num[12];
+                auto q = num + sizeof(num);
+                auto u = (uint32_t) v;
+                auto neg = c == 'd' && (int) u < 0;
+                if (neg)
+                    u = 0U - u;
+                auto radix = c == 'x' ? 16U : 10U;
+                do {
+                    *--q = "0123456789abcdef"[u % radix];
+                    u /= radix;
+                } while (u);
+                if (neg)
+                    *--q = '-';
+                out_write(q, (uint32_t) (num + sizeof(num) - q));
+                total += (int) (num + sizeof(num) - q);
+                continue;
+            }
+            if (width > 0)
+                len += snprintf(spec + len, sizeof(spec) - len, "%d", width);
+            if (prec >= 0)
+                len += snprintf(spec + len, sizeof(spec) - len, ".%d", prec);
+            if (strchr("diuxXo", c) && longs >= 2) {
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+            }
+            spec[len++] = c;
+            spec[len] = 0;
+            char buf[128];
+            std::vector<char> big;
+            auto out = buf;
+            auto size = sizeof(buf);
+            auto m = 0;
+            for (auto retry = 0; retry < 2; retry++) {
+                switch (c) {
+                    case 'd':
+                    case 'i':
+                        m = longs >= 2 ? snprintf(out, size, spec, (long long) v) : snprintf(out, size, spec, (int) v);
+                        break;
+                    case 'u':
+                    case 'x':
+                    case 'X':
+                    case 'o':
+                        m = longs >= 2 ? snprintf(out, size, spec, (unsigned long long) v) :
+                            snprintf(out, size, spec, (unsigned int) v);
+                        break;
+                    case 'c':
+                        m = snprintf(out, size, spec, (int) (char) v);
+                        break;
+                    case 'p':
+                        m = snprintf(out, size, "0x%08X", (uint32_t) v);
+                        break;
+                    case 'f':
+                    case 'F':
+                    case 'e':
+                    case 'E':
+                    case 'g':
+                    case 'G':
+                    case 'a':
+                    case 'A': {
+                        double d;
+                        if (longs > 0) {
+                            memcpy(&d, &v, sizeof(d));
+                        } else {
+                            float f;
+                            auto bits = (uint32_t) v;
+                            memcpy(&f, &bits, sizeof(f));
+                            d = f;
+                        }
+                        m = snprintf(out, size, spec, d);
+                    }
+                        break;
+                    default: // 不支持的说明（包括%n）原样输出
+                        m = snprintf(out, size, "%s", spec);
+                        break;
+                }
+                if (m < 0 || (size_t) m < size)
+                    break;
+                big.resize((size_t) m + 1); // 宽度或精度很大时扩大缓冲区再格式化一次
+                out = big.data();
+                size = big.size();
+            }
+            if (m > 0) {
+                emit(out, (uint32_t) m);
+                total += m;
+            }
+        }
+        if (line || outbuf.empty())
+            flush_locked();
+        return total;
+    }
+
+    cvm_state_t cvm::exec(int budget) {
+        if (state == vm_exit)
+            return state;
+        try {
+            state = run(regs, budget);
+        } catch (...) {
+            flush();
+            throw;
+        }
+        if (state == vm_exit)
+            flush();
+        return state;
+    }
+
+    void cvm::wait() {
+        if (state == vm_exit || task_poll())
+            return;
+        io_wait_any();
+    }
+
+    cvm_state_t cvm::run(cvm_ctx &ctx, int budget) {
+        auto main = &ctx == &regs; // 主线程（可调度协程），否则为工作线程
+        auto data = DATA_BASE;
+        auto base = USER_BASE;
 
 #if 0
-        if (log) {
+        if (ctx.log) {
             printf("\n---------------- STACK BEGIN <<<< \n");
-            printf("AX: %08X BP: %08X SP: %08X\n", ax, bp, sp);
-            for (uint32_t i = sp; i < STACK_BASE + PAGE_SIZE; i += 4) {
+            printf("AX: %08X BP: %08X SP: %08X\n", ctx.ax, ctx.bp, ctx.sp);
+            for (uint32_t i = ctx.sp; i < ctx.stack; i += 4) {
                 printf("[%08X]> %08X\n", i, vmm_get<uint32_t>(i));
             }
             printf("---------------- STACK END >>>>\n\n");
         }
 #endif
 
-        auto cycle = 0;
-        uint32_t args[6];
-        while (true) {
-            cycle++;
-            auto op = vmm_get(pc); // get next operation code
-            pc += INC_PTR;
+        auto &syscalls = syscall_table();
+        ulong count = 0;
+        while (budget < 0 || budget-- > 0) {
+            count++;
+            auto op = vmm_get(ctx.pc); // get next operation code
+            ctx.pc += INC_PTR;
 
 #if 0
             assert(op <= EXIT);
             // print debug info
             if (true) {
-                printf("%04d> [%08X] %02d %.4s", cycle, pc, op,
+                printf("%04d> [%08X] %02d %.4s", (int) (cycle + count), ctx.pc, op,
                        &"NOP, LEA ,IMM ,IMX ,JMP ,CALL,JZ  ,JNZ ,ENT ,ADJ ,LEV ,LI  ,SI  ,LC  ,SC  ,PUSH,LOAD,"
                         "OR  ,XOR ,AND ,EQ  ,NE  ,LT  ,GT  ,LE  ,GE  ,SHL ,SHR ,ADD ,SUB ,MUL ,DIV ,MOD ,"
-                        "OPEN,READ,CLOS,PRTF,MALC,MSET,MCMP,TRAC,TRAN,EXIT"[op * 5]);
+                        "SYSC,EXIT"[op * 5]);
                 if (op == PUSH)
-                    printf(" %08X\n", (uint32_t) ax);
-                else if (op <= ADJ)
-                    printf(" %d\n", vmm_get(pc));
+                    printf(" %08X\n", (uint32_t) ctx.ax);
+                else if (op <= ADJ || op == SYSC)
+                    printf(" %d\n", vmm_get(ctx.pc));
                 else
                     printf("\n");
             }
 #endif
             switch (op) {
                 case IMM: {
-                    ax = vmm_get(pc);
-                    pc += INC_PTR;
+                    ctx.ax = vmm_get(ctx.pc);
+                    ctx.pc += INC_PTR;
                 } /* load immediate value to ax */
                     break;
                 case LI: {
-                    ax = vmm_get(ax);
+                    ctx.ax = vmm_get(ctx.ax);
                 } /* load integer to ax, address in ax */
                     break;
                 case SI: {
-                    vmm_set(vmm_popstack(sp), ax);
+                    vmm_set(vmm_popstack(ctx.sp), ctx.ax);
                 } /* save integer to address, value in ax, address on stack */
                     break;
                 case LC: {
-                    ax = vmm_get<byte>(ax);
+                    ctx.ax = vmm_get<byte>(ctx.ax);
                 } /* load integer to ax, address in ax */
                     break;
                 case SC: {
-                    vmm_set<byte>(vmm_popstack(sp), ax & 0xff);
+                    vmm_set<byte>(vmm_popstack(ctx.sp), ctx.ax & 0xff);
                 } /* save integer to address, value in ax, address on stack */
                     break;
                 case LOAD: {
-                    ax = data | ((ax) & (PAGE_SIZE - 1));
+                    ctx.ax = data | ((ctx.ax) & (PAGE_SIZE - 1));
                 } /* load the value of ax, segment = DATA_BASE */
                     break;
                 case PUSH: {
-                    vmm_pushstack(sp, ax);
+                    vmm_pushstack(ctx.sp, ctx.ax);
                 } /* push the value of ax onto the stack */
                     break;
                 case JMP: {
-                    pc = base + vmm_get(pc) * INC_PTR;
+                    ctx.pc = base + vmm_get(ctx.pc) * INC_PTR;
                 } /* jump to the address */
                     break;
                 case JZ: {
-                    pc = ax ? pc + INC_PTR : (base + vmm_get(pc) * INC_PTR);
+                    ctx.pc = ctx.ax ? ctx.pc + INC_PTR : (base + vmm_get(ctx.pc) * INC_PTR);
                 } /* jump if ax is zero */
                     break;
                 case JNZ: {
-                    pc = ax ? (base + vmm_get(pc) * INC_PTR) : pc + INC_PTR;
+                    ctx.pc = ctx.ax ? (base + vmm_get(ctx.pc) * INC_PTR) : ctx.pc + INC_PTR;
                 } /* jump if ax is zero */
                     break;
                 case CALL: {
-                    vmm_pushstack(sp, pc + INC_PTR);
-                    pc = base + vmm_get(pc) * INC_PTR;
+                    vmm_pushstack(ctx.sp, ctx.pc + INC_PTR);
+                    ctx.pc = base + vmm_get(ctx.pc) * INC_PTR;
 #if 0
-                    printf("CALL> PC=%08X\n", pc);
+                    printf("CALL> PC=%08X\n", ctx.pc);
 #endif
                 } /* call subroutine */
                     /* break;case RET: {pc = (int *)*sp++;} // return from subroutine; */
                     break;
                 case ENT: {
-                    vmm_pushstack(sp, bp);
-                    bp = sp;
-                    sp = sp - vmm_get(pc);
-                    pc += INC_PTR;
+                    vmm_pushstack(ctx.sp, ctx.bp);
+                    ctx.bp = ctx.sp;
+                    ctx.sp = ctx.sp - vmm_get(ctx.pc);
+                    ctx.pc += INC_PTR;
                 } /* make new stack frame */
                     break;
                 case ADJ: {
-                    sp = sp + vmm_get(pc) * INC_PTR;
-                    pc += INC_PTR;
+                    ctx.sp = ctx.sp + vmm_get(ctx.pc) * INC_PTR;
+                    ctx.pc += INC_PTR;
                 } /* add esp, <size> */
                     break;
                 case LEV: {
-                    sp = bp;
-                    bp = vmm_popstack(sp);
-                    pc = vmm_popstack(sp);
+                    ctx.sp = ctx.bp;
+                    ctx.bp = vmm_popstack(ctx.sp);
+                    ctx.pc = vmm_popstack(ctx.sp);
 #if 0
-                    printf("RETURN> PC=%08X\n", pc);
+                    printf("RETURN> PC=%08X\n", ctx.pc);
 #endif
                 } /* restore call frame and PC */
                     break;
                 case LEA: {
-                    ax = bp + vmm_get(pc);
-                    pc += INC_PTR;
+                    ctx.ax = ctx.bp + vmm_get(ctx.pc);
+                    ctx.pc += INC_PTR;
                 } /* load address for arguments. */
                     break;
                 case OR:
-                    ax = vmm_popstack(sp) | ax;
+                    ctx.ax = vmm_popstack(ctx.sp) | ctx.ax;
                     break;
                 case XOR:
-                    ax = vmm_popstack(sp) ^ ax;
+                    ctx.ax = vmm_popstack(ctx.sp) ^ ctx.ax;
                     break;
                 case AND:
-                    ax = vmm_popstack(sp) & ax;
+                    ctx.ax = vmm_popstack(ctx.sp) & ctx.ax;
                     break;
                 case EQ:
-                    ax = vmm_popstack(sp) == ax;
+                    ctx.ax = vmm_popstack(ctx.sp) == ctx.ax;
                     break;
                 case NE:
-                    ax = vmm_popstack(sp) != ax;
+                    ctx.ax = vmm_popstack(ctx.sp) != ctx.ax;
                     break;
                 case LT:
-                    ax = vmm_popstack(sp) < ax;
+                    ctx.ax = vmm_popstack(ctx.sp) < ctx.ax;
                     break;
                 case LE:
-                    ax = vmm_popstack(sp) <= ax;
+                    ctx.ax = vmm_popstack(ctx.sp) <= ctx.ax;
                     break;
                 case GT:
-                    ax = vmm_popstack(sp) > ax;
+                    ctx.ax = vmm_popstack(ctx.sp) > ctx.ax;
                     break;
                 case GE:
-                    ax = vmm_popstack(sp) >= ax;
+                    ctx.ax = vmm_popstack(ctx.sp) >= ctx.ax;
                     break;
                 case SHL:
-                    ax = vmm_popstack(sp) << ax;
+                    ctx.ax = vmm_popstack(ctx.sp) << ctx.ax;
                     break;
                 case SHR:
-                    ax = vmm_popstack(sp) >> ax;
+                    ctx.ax = vmm_popstack(ctx.sp) >> ctx.ax;
                     break;
                 case ADD:
-                    ax = vmm_popstack(sp) + ax;
+                    ctx.ax = vmm_popstack(ctx.sp) + ctx.ax;
                     break;
                 case SUB:
-                    ax = vmm_popstack(sp) - ax;
+                    ctx.ax = vmm_popstack(ctx.sp) - ctx.ax;
                     break;
                 case MUL:
-                    ax = vmm_popstack(sp) * ax;
+                    ctx.ax = vmm_popstack(ctx.sp) * ctx.ax;
                     break;
                 case DIV:
-                    ax = vmm_popstack(sp) / ax;
+                    ctx.ax = vmm_popstack(ctx.sp) / ctx.ax;
                     break;
                 case MOD:
-                    ax = vmm_popstack(sp) % ax;
+                    ctx.ax = vmm_popstack(ctx.sp) % ctx.ax;
                     break;
                     // --------------------------------------
-                case PRTF: {
-                    init_args(args, sp, pc);
-                    ax = printf(vmm_getstr(args[0]), args[1], args[2], args[3], args[4], args[5]);
+                case SYSC: {
+                    auto operand = vmm_get(ctx.pc);
+                    ctx.pc += INC_PTR;
+                    auto id = SYSC_ID(operand);
+                    if (id >= syscalls.count.load(std::memory_order_acquire)) {
+                        printf("unknown syscall: %d\n", id);
+                        throw std::exception();
+                    }
+                    auto &sys = syscalls.calls[id];
+                    cvm_call call(*this, ctx, SYSC_ARGC(operand), main, budget); // 参数个数由cgen写入操作数
+                    auto ret = sys.fn(call);
+                    if (!call.suspend)
+                        ctx.ax = ret;
                 }
                     break;
                 case EXIT: {
-                    printf("exit(%d)\n", ax);
-                    return ax;
-                }
-                    break;
-                case OPEN: {
-                    init_args(args, sp, pc);
-                    ax = (int) fopen(vmm_getstr(args[0]), "rb");
-#if 0
-                    printf("OPEN> name=%s fd=%08X\n", vmm_getstr(args[0]), ax);
-#endif
-                }
-                    break;
-                case READ: {
-                    init_args(args, sp, pc);
-#if 0
-                    printf("READ> src=%p size=%08X fd=%08X\n", vmm_getstr(args[1]), args[2], args[0]);
-#endif
-                    ax = (int) fread(vmm_getstr(args[1]), 1, (size_t) args[2], (FILE *) args[0]);
-                    if (ax > 0) {
-                        rewind((FILE *) args[0]); // 坑：避免重复读取
-                        ax = (int) fread(vmm_getstr(args[1]), 1, (size_t) ax, (FILE *) args[0]);
-                        vmm_getstr(args[1])[ax] = 0;
-#if 0
-                        printf("READ> %s\n", vmm_getstr(args[1]));
-#endif
+                    if (!main) { // 线程结束，返回值在ax中
+                        cycle += count;
+                        return vm_exit;
                     }
-                }
-                    break;
-                case CLOS: {
-                    init_args(args, sp, pc);
-                    ax = (int) fclose((FILE *) args[0]);
-                }
-                    break;
-                case MALC: {
-                    init_args(args, sp, pc);
-                    ax = (int) vmm_malloc((uint32_t) args[0]);
-                }
-                    break;
-                case MSET: {
-                    init_args(args, sp, pc);
-#if 0
-                    printf("MEMSET> PTR=%08X SIZE=%08X VAL=%d\n", (uint32_t)vmm_getstr(args[0]), (uint32_t)args[2], (uint32_t)args[1]);
-#endif
-                    ax = (int) vmm_memset(args[0], (uint32_t) args[1], (uint32_t) args[2]);
-                }
-                    break;
-                case MCMP: {
-                    init_args(args, sp, pc);
-                    ax = (int) vmm_memcmp(args[0], args[1], (uint32_t) args[2]);
-                }
-                    break;
-                case TRAC: {
-                    init_args(args, sp, pc);
-                    ax = log;
-                    log = args[0] != 0;
-                }
-                    break;
-                case TRAN: {
-                    init_args(args, sp, pc);
-                    ax = (uint32_t) vmm_getstr(args[0]);
+                    if (current != 0) { // 协程结束，返回值在ax中
+                        task_exit();
+                        break;
+                    }
+                    halt = true;
+                    print("exit(%d)\n", ctx.ax);
+                    exit_code = ctx.ax;
+                    cycle += count;
+                    return vm_exit;
                 }
                     break;
                 default: {
-                    printf("AX: %08X BP: %08X SP: %08X PC: %08X\n", ax, bp, sp, pc);
-                    for (uint32_t i = sp; i < STACK_BASE + PAGE_SIZE; i += 4) {
+                    printf("AX: %08X BP: %08X SP: %08X PC: %08X\n", ctx.ax, ctx.bp, ctx.sp, ctx.pc);
+                    for (uint32_t i = ctx.sp; i < ctx.stack; i += 4) {
                         printf("[%08X]> %08X\n", i, vmm_get<uint32_t>(i));
                     }
                     printf("unknown instruction:%d\n", op);
@@ -573,16 +2345,17 @@ namespace clib {
             }
 
 #if 1
-            if (log) {
+            if (ctx.log) {
                 printf("\n---------------- STACK BEGIN <<<< \n");
-                printf("AX: %08X BP: %08X SP: %08X PC: %08X\n", ax, bp, sp, pc);
-                for (uint32_t i = sp; i < STACK_BASE + PAGE_SIZE; i += 4) {
+                printf("AX: %08X BP: %08X SP: %08X PC: %08X\n", ctx.ax, ctx.bp, ctx.sp, ctx.pc);
+                for (uint32_t i = ctx.sp; i < ctx.stack; i += 4) {
                     printf("[%08X]> %08X\n", i, vmm_get<uint32_t>(i));
                 }
                 printf("---------------- STACK END >>>>\n\n");
             }
 #endif
         }
-        return 0;
+        cycle += count;
+        return vm_yield;
     }
 }
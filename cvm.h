@@ -6,9 +6,23 @@
 #ifndef CMINILANG_VM_H
 #define CMINILANG_VM_H
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <initializer_list>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include "types.h"
 #include "memory.h"
+#include "cmmap.h"
+#include "cfile.h"
+#include "cpool.h"
+#include "chash.h"
+#include "cchan.h"
 
 namespace clib {
 
@@ -62,6 +76,7 @@ namespace clib {
 #define PTE_A   0x20    // 可访问 Accessed
 #define PTE_S   0x40    // Page size, 0 for 4kb pre page
 #define PTE_G   0x80    // Ignored
+#define PTE_COW 0x200   // 写时复制，fork后父子共享的页面，首次写入时复制
 
 /* 用户代码段基址 */
 #define USER_BASE 0xc0000000
@@ -69,26 +84,265 @@ namespace clib {
 #define DATA_BASE 0xd0000000
 /* 用户栈基址 */
 #define STACK_BASE 0xe0000000
+/* 协程数上限，协程i的栈位于STACK_BASE+2*i*PAGE_SIZE，栈之间留一页作保护 */
+#define TASK_MAX 256
+/* 线程数上限，线程栈排在协程栈之后 */
+#define THREAD_MAX 64
+/* 线程每次连续执行的指令数 */
+#define THREAD_SLICE 10000
+/* parallel_for工作线程数上限，栈排在线程栈之后 */
+#define WORKER_MAX 32
 /* 用户堆基址 */
 #define HEAP_BASE 0xf0000000
 /* 用户堆大小 */
 #define HEAP_SIZE 1000
+/* 文件映射区基址，位于堆之后，至地址空间末尾 */
+#define MMAP_BASE 0xf1000000
+/* 文件映射区大小 */
+#define MMAP_SIZE (0u - MMAP_BASE - PAGE_SIZE)
 /* 段掩码 */
 #define SEGMENT_MASK 0x0fffffff
 
+/* 文件句柄数上限，0、1、2为标准输入、输出（即虚拟机的输出）、错误 */
+#define FILE_MAX 256
+/* 每个虚拟机未完成的异步读写数上限 */
+#define IO_MAX 256
+/* 系统调用数上限 */
+#define SYSCALL_MAX 256
+/* 默认输出缓冲区大小，为0时不缓冲 */
+#define OUTPUT_SIZE (64 * 1024)
 /* 物理内存(单位：16B) */
-#define PHY_MEM (16 * 1024)
-/* 堆内存(单位：16B) */
-#define HEAP_MEM (256 * 1024)
+#define PHY_MEM (256 * 1024)
+
+    // 虚拟机状态
+    enum cvm_state_t {
+        vm_ready, // 已设置入口，尚未运行
+        vm_yield, // 指令配额用完，可继续运行
+        vm_exit,  // 程序已退出
+    };
+
+    // 寄存器
+    struct cvm_ctx {
+        uint32_t stack{0}; // 栈底（最高地址）
+        uint32_t pc{0};
+        uint32_t sp{0};
+        uint32_t bp{0};
+        int ax{0};
+        bool log{false};
+    };
+
+    // 协程状态
+    enum cvm_task_state_t {
+        task_free,  // 空闲，可被spawn复用
+        task_ready, // 可运行
+        task_join,  // 等待其他协程结束
+        task_dead,  // 已结束，等待join回收
+        task_io,    // 等待异步读写完成
+    };
+
+    // 协程
+    struct cvm_task {
+        cvm_ctx ctx;
+        cvm_task_state_t state{task_free};
+        int join{-1}; // 等待的协程或异步读写请求
+    };
+
+    // 异步读写请求，在I/O线程中完成
+    struct cvm_io {
+        bool used{false};
+        bool done{false};
+        int result{0};
+    };
+
+    // I/O线程与虚拟机生存期的同步，由虚拟机和I/O线程共同持有
+    struct cvm_io_ctl {
+        std::mutex lock;
+        std::condition_variable cv;
+        bool alive{true}; // 虚拟机析构后为false，之后的请求不再访问虚拟机
+        int running{0};   // 正在访问虚拟机的请求数
+    };
+
+    // 线程，与主线程共享地址空间，栈独立
+    struct cvm_thread {
+        cvm_ctx ctx;
+        std::thread th;
+        bool joining{false};
+    };
+
+    // 输出，虚拟机中printf的结果和退出信息写到这里
+    using cvm_output = std::function<void(const char *buf, size_t len)>;
+
+    // 输出缓冲的刷新时机，缓冲区满和虚拟机退出时总会刷新
+    enum cvm_flush_t {
+        flush_full, // 仅在缓冲区满时
+        flush_line, // 另外在每次换行时
+        flush_auto, // 输出到终端时同flush_line，否则同flush_full
+    };
+
+    class cvm;
+
+    // 一次系统调用，参数在虚拟机栈上，处理函数通过它读写虚拟机内存
+    class cvm_call {
+    public:
+        // 参数个数
+        int argc() const;
+        // 第i个参数，直接读取栈上的参数
+        uint32_t arg(int i) const { return slots[n - 1 - i]; }
+        // 第i个参数所指的字符串，不跨页时直接指向虚拟机内存，否则为副本，在本次调用中有效
+        const char *str(int i) const;
+        // 复制第i个参数所指的字符串，可跨页
+        string_t string(int i) const;
+        // 把字符串复制到虚拟机的堆上，返回地址
+        uint32_t new_str(const char *s, uint32_t len) const;
+        // 读写虚拟机内存，可跨页
+        void read(uint32_t va, void *dst, uint32_t size) const;
+        void write(uint32_t va, const void *src, uint32_t size) const;
+        // 在虚拟机的堆上申请内存
+        uint32_t malloc(uint32_t size) const;
+
+    private:
+        friend class cvm;
+        cvm_call(cvm &vm, cvm_ctx &ctx, int argc, bool main, int &budget);
+
+        // 稍后重新执行本次调用，不设置返回值
+        void again();
+
+        cvm &vm;
+        cvm_ctx &ctx;
+        int n;
+        const uint32_t *slots{nullptr}; // 栈上的参数，最后一个参数在最低地址
+        bool main; // 主线程（可调度协程）
+        int &budget;
+        bool suspend{false};
+        mutable std::list<string_t> strs; // 跨页字符串的副本
+    };
+
+    // 系统调用的处理函数，返回值即调用的返回值
+    using cvm_syscall_t = std::function<int(cvm_call &)>;
+
+    // 系统调用表项
+    struct cvm_syscall {
+        string_t name;
+        int arity{-1}; // 参数个数，-1为不限
+        cvm_syscall_t fn;
+    };
+
+    // 虚拟机的页框，fork后由父子虚拟机共同持有
+    struct cvm_mem {
+        cvm_mem();
+        ~cvm_mem();
+
+        /* 物理内存(1 block=16B) */
+        memory_pool<PHY_MEM> memory;
+        /* 堆内存，HEAP_SIZE页 */
+        byte *heapBase;
+        byte *heapHead;
+        /* 写时复制申请的页框 */
+        std::vector<byte *> frames;
+        /* 快照文件的映射 */
+        std::unique_ptr<cmmap> image;
+        /* mmap_file映射的文件 */
+        std::vector<std::unique_ptr<cmmap>> maps;
+
+        // 申请写时复制用的页框，随cvm_mem一起释放
+        byte *alloc_frame();
+    };
+
+    // 编译后的代码页，同一程序的所有虚拟机共享一份，只读映射
+    struct cvm_code {
+        explicit cvm_code(const std::vector<LEX_T(int)> &text);
+        // 直接使用镜像文件中按页对齐的代码，不复制
+        cvm_code(std::shared_ptr<cmmap> map, uint32_t offset, uint32_t pages);
+        ~cvm_code();
+        cvm_code(const cvm_code &) = delete;
+        cvm_code &operator=(const cvm_code &) = delete;
+
+        byte *base;
+        byte *head;
+        uint32_t pages;
+        std::shared_ptr<cmmap> map;
+    };
 
     class cvm {
     public:
         explicit cvm(const std::vector<LEX_T(int)> &text, const std::vector<LEX_T(char)> &data);
+        cvm(std::shared_ptr<const cvm_code> code, const std::vector<LEX_T(char)> &data);
         ~cvm();
 
-        int exec(int entry = -1);
+        // 复制虚拟机，父子共享全部页框，页面标记为写时复制
+        // 不复制线程，调用时不应有线程在运行；已打开的文件、通道表为父子共用
+        std::unique_ptr<cvm> fork();
+        // 从checkpoint()保存的快照恢复，页面直接映射自快照文件
+        static std::unique_ptr<cvm> restore(const char *path);
+
+        // 设置入口，压入main参数；可再次调用以重新运行，堆从头分配，数据段保留上次的值
+        void init(int entry, int argc, char **argv);
+        // 运行至多budget条指令，budget<0时运行至退出
+        // 协程都在等待异步读写时提前返回vm_yield
+        cvm_state_t exec(int budget = -1);
+        // 阻塞至有协程可以继续运行
+        void wait();
+
+        // 设置输出，out为空时输出到stdout
+        void set_output(cvm_output out, uint32_t size = OUTPUT_SIZE, cvm_flush_t policy = flush_auto);
+        // 输出缓冲区中的内容
+        void flush();
+        // 与其他虚拟机共用通道表，须在运行前设置；默认每个虚拟机有自己的通道表
+        void set_chans(std::shared_ptr<cchan_set> set);
+        // 输出到文件
+        static cvm_output file_output(FILE *f);
+
+        // 注册系统调用，返回调用号，重名或表满时返回-1
+        // 系统调用表为进程内共享，脚本编译时按名称查找，应在编译前注册
+        static int add_syscall(const string_t &name, int arity, cvm_syscall_t fn);
+        // 已注册的系统调用个数，内建函数在前
+        static int syscall_count();
+        // 按调用号取系统调用，不存在时返回空
+        static const cvm_syscall *get_syscall(int id);
+
+        cvm_state_t get_state() const;
+        int get_exit_code() const;
+        ulong get_cycle() const;
 
     private:
+        friend class cvm_call;
+
+        cvm();
+
+        // 注册内建函数
+        static void builtin_syscalls();
+
+        // 格式化到输出缓冲区
+        int print(const char *fmt, ...);
+        // 输出缓冲区，调用时持有out_lock
+        void flush_locked();
+        // 写入输出缓冲区，调用时持有out_lock
+        void out_write(const char *p, uint32_t n);
+        // 把虚拟机中的字符串逐页写入输出缓冲区，返回长度；nl非空时记录是否有换行
+        uint32_t out_str(uint32_t va, uint32_t max, bool *nl = nullptr);
+        // 虚拟机中的printf，参数个数不限，%s直接读取虚拟机内存
+        int vm_printf(uint32_t fmt, const uint32_t *args, int argc);
+        // 取va所在页的宿主地址，n为本页剩余字节数
+        const char *vmm_page(uint32_t va, uint32_t *n) const;
+        // 虚拟机中字符串的长度，至多max
+        uint32_t vmm_strlen(uint32_t va, uint32_t max) const;
+        // 以下逐页调用字符串内核，字符串可跨页
+        int vmm_strcmp(uint32_t a, uint32_t b) const;
+        // 第一个c的地址，没有时返回0
+        uint32_t vmm_strchr(uint32_t va, char c) const;
+        uint32_t vmm_memchr(uint32_t va, char c, uint32_t size) const;
+        // 复制字符串，返回dst
+        uint32_t vmm_strcpy(uint32_t dst, uint32_t src);
+        // 取字符串及其长度，不跨页时直接返回宿主地址，否则复制到buf
+        const char *vmm_strref(uint32_t va, uint32_t *len, string_t &buf);
+        // [va, va + size)在宿主内存中连续且可直接写入时返回宿主地址，否则返回空
+        byte *vmm_span(uint32_t va, uint32_t size) const;
+        // n个size字节的元素不溢出且都在已映射的页上，否则报错
+        void vmm_checkarray(uint32_t va, uint32_t n, uint32_t size, const char *fn) const;
+        // 对虚拟机中的n个T原地执行f(begin, end)，不连续时先复制出来，完成后写回
+        template<class T, class F>
+        void vmm_inplace(uint32_t va, uint32_t n, F f);
+
         // 申请页框
         uint32_t pmm_alloc();
         // 初始化页表
@@ -99,6 +353,12 @@ namespace clib {
         void vmm_unmap(pde_t *pgdir, uint32_t va);
         // 查询分页情况
         int vmm_ismap(uint32_t va, uint32_t *pa) const;
+        // 取页表项，页面不存在时返回空
+        pte_t *vmm_pte(uint32_t va) const;
+        // 写时复制
+        void vmm_cow(uint32_t va, pte_t *pte);
+        // 取可写的宿主地址，必要时复制页面
+        byte *vmm_wptr(uint32_t va);
 
         template<class T = int>
         T vmm_get(uint32_t va);
@@ -106,28 +366,141 @@ namespace clib {
         template<class T = int>
         T vmm_set(uint32_t va, T);
         void vmm_setstr(uint32_t va, const char *value);
+        // 跨页拷贝
+        bool vmm_isspan(uint32_t va, uint32_t size) const;
+        // 都可写入（含写时复制的页面）
+        bool vmm_iswspan(uint32_t va, uint32_t size) const;
+        void vmm_read(uint32_t va, void *dst, uint32_t size);
+        void vmm_write(uint32_t va, const void *src, uint32_t size);
         uint32_t vmm_malloc(uint32_t size);
+        // 把文件只读映射到文件映射区，页面直接使用宿主的映射，返回地址，失败返回0
+        // 文件之后至少有一个'\0'
+        uint32_t vmm_mmap(const char *path);
+        // 打开文件，返回句柄，失败返回-1
+        int file_open(const char *path, int flags);
+        int file_close(int fd);
+        // 取句柄对应的文件，句柄无效或为标准输出时返回空
+        std::shared_ptr<cfile> file_get(int fd);
+        // 读入至多size字节，逐页直接写入虚拟机内存，返回读入字节数，出错返回-1
+        // at为真时从offset处读入，不改变当前位置
+        int file_read(int fd, uint32_t va, uint32_t size, bool at = false, int64_t offset = 0);
+        // 把虚拟机内存逐页写入文件，句柄1写入输出缓冲区
+        int file_write(int fd, uint32_t va, uint32_t size);
+        // 按句柄取散列表、动态数组，句柄无效时报错，调用时持有coll_lock
+        chash &coll_map(int h, const char *fn);
+        std::vector<int> &coll_vec(int h, const char *fn);
+        // 提交异步读写，返回请求号，失败返回-1
+        // 普通文件由共享的I/O线程池执行file_read/file_write；管道、终端等可能一直阻塞的文件
+        // 各用一个线程读写宿主缓冲区，虚拟机析构时不再等待，之后完成的结果被丢弃
+        int io_submit(bool write, int fd, uint32_t va, uint32_t size);
+        // 记录请求的结果并唤醒等待者
+        void io_complete(int id, int result);
+        // 请求已完成时取出结果并回收请求号；请求号无效时结果为-1
+        bool io_result(int id, int *result);
+        // 等待请求完成
+        void io_wait(int id);
+        // 等待任一协程所等的请求完成
+        void io_wait_any();
+        // 请求是否已完成，调用时持有io_lock
+        bool io_done(int id) const;
         uint32_t vmm_memset(uint32_t va, uint32_t value, uint32_t count);
         uint32_t vmm_memcmp(uint32_t src, uint32_t dst, uint32_t count);
+        std::atomic<int> *vmm_atomic(uint32_t va);
         template<class T = int>
         void vmm_pushstack(uint32_t &sp, T value);
         template<class T = int>
         T vmm_popstack(uint32_t &sp);
 
-        void init_args(uint32_t *args, uint32_t sp, uint32_t pc, bool converted = false);
+        // 解释执行，主线程传入regs，工作线程传入各自的寄存器
+        cvm_state_t run(cvm_ctx &ctx, int budget);
+        // 设置栈，使之调用func(arg)，返回后结束
+        void init_call(cvm_ctx &ctx, uint32_t stack, uint32_t func, std::initializer_list<uint32_t> args);
+        // 在调用者的栈下方同步调用虚拟机中的函数，返回其返回值
+        int vm_call(const cvm_ctx &ctx, uint32_t func, std::initializer_list<uint32_t> args);
+
+        // 协程栈顶
+        static uint32_t task_stack(int id);
+        // 新建协程，返回协程号
+        int task_spawn(uint32_t func, uint32_t arg);
+        // 当前协程结束
+        void task_exit();
+        // 保存当前协程，切换至下一个就绪协程，没有时等待异步读写完成
+        void task_switch();
+        // 把异步读写已完成的协程设为就绪，返回是否有就绪的协程
+        bool task_poll();
+
+        // 保存快照，有线程在运行、有未完成的异步读写或有散列表、动态数组时返回-1
+        // 已打开的文件不保存，恢复后只有标准输入、输出、错误
+        int checkpoint(const char *path);
+
+        // 线程栈顶
+        static uint32_t thread_stack(int id);
+        // 新建线程，返回线程号
+        int thread_create(uint32_t func, uint32_t arg);
+        // 等待线程结束，返回其返回值
+        int thread_join(int id);
+
+        // 线程池栈顶
+        static uint32_t worker_stack(int id);
+        // 在线程池上对[lo, hi)中的每个i执行func(i, arg)
+        int parallel_for(int lo, int hi, uint32_t func, uint32_t arg);
 
     private:
         /* 内核页表 = PTE_SIZE*PAGE_SIZE */
         pde_t *pgd_kern;
-        /* 内核页表内容 = PTE_COUNT*PTE_SIZE*PAGE_SIZE */
-        pde_t *pte_kern;
-        /* 物理内存(1 block=16B) */
-        memory_pool<PHY_MEM> memory;
         /* 页表 */
         pde_t *pgdir{nullptr};
-        /* 堆内存 */
-        memory_pool<HEAP_MEM> heap;
-        byte *heapHead;
+        /* 代码页 */
+        std::shared_ptr<const cvm_code> code;
+        /* 本虚拟机的页框 */
+        std::shared_ptr<cvm_mem> mem;
+        /* fork来源的页框，共享页面在子虚拟机结束前不能释放 */
+        std::vector<std::shared_ptr<cvm_mem>> refs;
+        /* 堆顶偏移 */
+        uint32_t heap_brk{0};
+        /* 文件映射区已用大小 */
+        uint32_t map_brk{0};
+        /* 输出 */
+        cvm_output output;
+        std::vector<char> outbuf;
+        uint32_t outlen{0};
+        bool outline{false};
+        std::mutex out_lock;
+        /* 文件句柄表，fork后父子共用已打开的文件 */
+        std::vector<std::shared_ptr<cfile>> files;
+        std::mutex file_lock;
+        /* 散列表、动态数组，句柄为下标加1，fork后子虚拟机得到副本 */
+        std::vector<std::unique_ptr<chash>> maps;
+        std::vector<std::unique_ptr<std::vector<int>>> vecs;
+        std::mutex coll_lock;
+        /* 通道表 */
+        std::shared_ptr<cchan_set> chans;
+        /* 异步读写请求 */
+        std::vector<cvm_io> ios;
+        std::shared_ptr<cvm_io_ctl> io_ctl{std::make_shared<cvm_io_ctl>()};
+        std::mutex io_lock;
+        std::condition_variable io_cv;
+        /* 寄存器 */
+        cvm_ctx regs;
+        /* 协程表，0号为main */
+        std::vector<cvm_task> tasks;
+        /* 当前协程 */
+        int current{0};
+        /* 状态 */
+        cvm_state_t state{vm_ready};
+        /* 退出码 */
+        int exit_code{0};
+        /* 已执行指令数 */
+        std::atomic<ulong> cycle{0};
+        /* 线程表 */
+        std::vector<std::unique_ptr<cvm_thread>> threads;
+        std::mutex thread_lock;
+        /* parallel_for线程池 */
+        std::unique_ptr<cpool> pool;
+        /* 主线程退出，通知其他线程停止 */
+        std::atomic<bool> halt{false};
+        /* 页表、物理内存及堆分配锁 */
+        std::recursive_mutex mm_lock;
     };
 }
 
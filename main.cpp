@@ -3,19 +3,183 @@
 // Author: bajdcc
 //
 
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ccache.h"
+#include "cgen.h"
+#include "cimage.h"
 #include "cparser.h"
+#include "cpool.h"
+#include "cserve.h"
 #include "cvm.h"
 
-extern int g_argc;
-extern char** g_argv;
+// 设置了CMINILANG_CACHE时启用编译缓存
+static std::unique_ptr<clib::ccache> cache;
+
+static std::unique_ptr<clib::cimage> compile_file(char *path)
+{
+    std::ifstream in(path);
+    std::istreambuf_iterator<char> beg(in), end;
+    std::string str(beg, end);
+    if (str.empty()) {
+        return nullptr;
+    }
+    if (cache) {
+        auto img = cache->get(str);
+        if (img) {
+            return img;
+        }
+    }
+    clib::cparser p(str);
+    auto root = p.parse();
+    //clib::cast::print(root, 0, std::cout);
+    clib::cgen gen(root);
+    auto img = gen.image();
+    if (cache) {
+        cache->put(str, *img);
+    }
+    return img;
+}
+
+static int run_file(char *path, int argc, char **argv, std::shared_ptr<clib::cchan_set> chans = nullptr)
+{
+    try {
+        // 镜像文件直接载入，跳过编译
+        auto img = clib::cimage::is_image(path) ? clib::cimage::load(path) : compile_file(path);
+        if (!img) {
+            return -1;
+        }
+        clib::cvm vm(img->code, img->data);
+        if (chans)
+            vm.set_chans(chans);
+        vm.init(img->entry, argc, argv);
+        vm.exec();
+    } catch (const std::exception& e) {
+        printf("ERROR: %s\n", e.what());
+    }
+    return 0;
+}
+
+// 编译并保存镜像
+static int emit_image(char *out, char *path)
+{
+    try {
+        auto img = compile_file(path);
+        if (!img) {
+            return -1;
+        }
+        if (!img->save(out)) {
+            printf("ERROR: cannot write %s\n", out);
+            return -1;
+        }
+    } catch (const std::exception& e) {
+        printf("ERROR: %s\n", e.what());
+        return -1;
+    }
+    return 0;
+}
+
+// 从快照恢复运行，跳过编译和脚本初始化
+static int run_snapshot(char *path)
+{
+    try {
+        auto vm = clib::cvm::restore(path);
+        vm->exec();
+    } catch (const std::exception& e) {
+        printf("ERROR: %s\n", e.what());
+        return -1;
+    }
+    return 0;
+}
+
+// 批量运行：线程池中并发编译、运行，每个脚本一个虚拟机，输出先缓存，结束后按顺序输出
+static int run_batch(int n, char **files)
+{
+    struct result_t {
+        std::mutex lock; // 脚本中的线程也会输出
+        std::string out;
+        double ms{0};
+        clib::ulong cycle{0};
+        int code{0};
+        bool ok{false};
+    };
+    std::vector<std::unique_ptr<result_t>> results;
+    for (auto i = 0; i < n; i++) {
+        results.emplace_back(new result_t);
+    }
+    auto workers = std::max(1, std::min(n, (int) std::thread::hardware_concurrency()));
+    auto start = std::chrono::steady_clock::now();
+    clib::cpool pool(workers);
+    pool.run(0, n, [&](int id, int lo, int hi) {
+        for (auto i = lo; i < hi; i++) {
+            auto &r = *results[i];
+            auto t0 = std::chrono::steady_clock::now();
+            try {
+                auto img = clib::cimage::is_image(files[i]) ? clib::cimage::load(files[i]) : compile_file(files[i]);
+                if (img) {
+                    clib::cvm vm(img->code, img->data);
+                    vm.set_output([&](const char *buf, clib::uint len) {
+                        std::lock_guard<std::mutex> guard(r.lock);
+                        r.out.append(buf, len);
+                    });
+                    vm.init(img->entry, 1, files + i);
+                    vm.exec();
+                    r.cycle = vm.get_cycle();
+                    r.code = vm.get_exit_code();
+                    r.ok = true;
+                } else {
+                    r.out = "ERROR: cannot open file\n";
+                }
+            } catch (const std::exception& e) {
+                r.out += std::string("ERROR: ") + e.what() + "\n";
+            }
+            r.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+        }
+    });
+    auto total = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    for (auto i = 0; i < n; i++) {
+        printf("==== %s ====\n", files[i]);
+        fwrite(results[i]->out.data(), 1, results[i]->out.size(), stdout);
+    }
+    printf("==== summary (%d workers) ====\n", workers);
+    printf("%-24s %10s %14s %6s\n", "script", "time(ms)", "instructions", "exit");
+    auto failed = 0;
+    for (auto i = 0; i < n; i++) {
+        auto &r = *results[i];
+        if (r.ok)
+            printf("%-24s %10.3f %14llu %6d\n", files[i], r.ms, (unsigned long long) r.cycle, r.code);
+        else
+            printf("%-24s %10.3f %14s %6s\n", files[i], r.ms, "-", "error");
+        failed += r.ok ? 0 : 1;
+    }
+    printf("total: %d scripts, %d failed, %.3f ms\n", n, failed, total);
+    return failed ? -1 : 0;
+}
+
+// 每个文件一个虚拟机、一个线程，之间用chan_send/chan_recv通信
+static int run_pipeline(int n, char **files)
+{
+    std::vector<std::thread> stages;
+    auto chans = std::make_shared<clib::cchan_set>(); // 各阶段共用通道表
+    for (auto i = 0; i < n; i++) {
+        stages.emplace_back([=]() { run_file(files[i], 1, files + i, chans); });
+    }
+    for (auto &stage : stages) {
+        stage.join();
+    }
+    return 0;
+}
 
 int main(int argc, char **argv)
 {
-    g_argc = argc;
-    g_argv = argv;
 #if 0
     string_t txt = R"(
 int fibonacci(int i) {
@@ -61,31 +225,59 @@ int main()
         auto root = p.parse();
         clib::cast::print(root, 0, std::cout);
         clib::cgen gen(root);
-        gen.eval();
+        gen.eval(argc, argv);
     } catch (const std::exception& e) {
         printf("ERROR: %s\n", e.what());
     }
 #else
-    g_argc--;
-    g_argv++;
-    if (g_argc < 1) {
+    argc--;
+    argv++;
+    auto dir = getenv("CMINILANG_CACHE");
+    if (dir && *dir) {
+        cache.reset(new clib::ccache(dir));
+    }
+    if (argc == 1 && strcmp(*argv, "--cache-stats") == 0) {
+        if (!cache) {
+            printf("CMINILANG_CACHE not set\n");
+            return -1;
+        }
+        auto hits = cache->hits(), misses = cache->misses();
+        printf("hits: %llu, misses: %llu, hit rate: %.1f%%\n", (unsigned long long) hits, (unsigned long long) misses,
+               hits + misses ? 100.0 * hits / (hits + misses) : 0.0);
+        return 0;
+    }
+    if (argc < 1) {
         printf("Usage: CMiniLang file ...\n");
+        printf("       CMiniLang --pipeline file ...\n");
+        printf("       CMiniLang --batch file ...\n");
+        printf("       CMiniLang --restore snapshot\n");
+        printf("       CMiniLang --emit-image image file\n");
+        printf("       CMiniLang --cache-stats\n");
+        printf("       CMiniLang --serve socket [workers]\n");
+        printf("       CMiniLang --bench socket requests concurrency file ...\n");
         return -1;
     }
-    std::ifstream in(*g_argv);
-    std::istreambuf_iterator<char> beg(in), end;
-    std::string str(beg, end);
-    if (str.empty()) {
-        exit(-1);
+    if (strcmp(*argv, "--emit-image") == 0 && argc == 3) {
+        return emit_image(argv[1], argv[2]);
     }
-    try {
-        clib::cparser p(str);
-        auto root = p.parse();
-        //clib::cast::print(root, 0, std::cout);
-        clib::cgen gen(root);
-        gen.eval();
-    } catch (const std::exception& e) {
-        printf("ERROR: %s\n", e.what());
+    if (strcmp(*argv, "--serve") == 0 && (argc == 2 || argc == 3)) {
+        auto workers = argc == 3 ? atoi(argv[2]) : (int) std::thread::hardware_concurrency();
+        return clib::cserve(argv[1]).run(workers > 0 ? workers : 1);
+    }
+    if (strcmp(*argv, "--bench") == 0 && argc >= 5) {
+        return clib::cserve::bench(argv[1], atoi(argv[2]), std::max(1, atoi(argv[3])), argc - 4, argv + 4);
+    }
+    if (strcmp(*argv, "--restore") == 0 && argc == 2) {
+        return run_snapshot(argv[1]);
+    }
+    if (strcmp(*argv, "--batch") == 0) {
+        return run_batch(argc - 1, argv + 1);
+    }
+    if (strcmp(*argv, "--pipeline") == 0) {
+        return run_pipeline(argc - 1, argv + 1);
+    }
+    if (run_file(*argv, argc, argv) != 0) {
+        exit(-1);
     }
 #endif
     return 0;
@@ -0,0 +1,945 @@
+//
+// Project: CMiniLang
+// Author: bajdcc
+//
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "../cminilang.h"
+#include "../ccache.h"
+
+using namespace clib;
+
+#define TEST_THREADS 4
+
+static const char *source = R"(
+int main(int argc, char **argv) {
+    int i, s, n;
+    n = argv[1][0] - '0';
+    s = 0;
+    i = 0;
+    while (i <= n * 100) {
+        s = s + i;
+        i++;
+    }
+    printf("argc=%d n=%d sum=%d twice=%d %s\n", argc, n, s, twice(n), repeat("ab", n));
+    return n;
+}
+)";
+
+// 参数为跨页的字符串：数据段的页面在宿主内存中不相邻，用长字符串常量占满第一页
+static std::string source_page(const std::string &fmt, const std::string &args) {
+    std::string pad(1000, 'x'), src = R"(
+int main() {
+    char *p, *s;
+    int i;
+)";
+    src += "    s = \"" + fmt + "\";\n"; // 数据段中的第一个字符串
+    for (auto i = 0; i < 5; i++)
+        src += "    p = \"" + pad + "\";\n";
+    src += R"(
+    p = (char *) ((((int) s + 4096) & ~4095) - 3);
+    i = 0;
+    while (i < 8) {
+        p[i] = 'a' + i;
+        i++;
+    }
+    p[8] = 0;
+)";
+    src += "    printf(s, " + args + ");\n    return 0;\n}\n";
+    return src;
+}
+
+// printf：宽度、精度、标志、*、%s为空指针、不完整或未知的说明
+static const char *source_printf = R"(
+int main() {
+    printf("[%5d|%-5d|%05d|%+d|%x|%X|%o|%u]\n", 42, 42, 42, 42, 255, 255, 8, -1);
+    printf("[%8s|%-8s|%.2s|%*d|%-*d|%.*s]\n", "abc", "abc", "abc", 4, 7, 4, 7, 3, "abcdef");
+    printf("[%c%c|%%|%5.1s|%s|%d]\n", 'o', 'k', "xyz", 0, -2147483647 - 1);
+    printf("[%k|%5]\n", 1);
+    printf("[%d %d]\n", 1);
+    printf("%d%", 5);
+    printf("|%-");
+    printf("\n%lld %p\n", 1, 0, 4096);
+    return 0;
+}
+)";
+
+static const char *expect_printf = "[   42|42   |00042|+42|ff|FF|10|4294967295]\n"
+                                   "[     abc|abc     |ab|   7|7   |abc]\n"
+                                   "[ok|%|    x|(null)|-2147483648]\n"
+                                   "[%k|%5]\n"
+                                   "[1 0]\n"
+                                   "5|\n"
+                                   "1 0x00001000\n"
+                                   "exit(0)\n";
+
+// 脚本中的同名函数、变量覆盖系统调用
+static const char *source_shadow = R"(
+int strlen(char *s) {
+    return 42;
+}
+int main() {
+    int write;
+    write = 3;
+    printf("%d %d %d\n", strlen("ab"), write, memchr("abc", 'c', 3) != 0);
+    return 0;
+}
+)";
+
+// 通道属于各自的虚拟机，前一次运行关闭的通道不影响之后的运行
+static const char *source_chan = R"(
+int main() {
+    char *b;
+    int n;
+    b = malloc(8);
+    n = chan_send(5, "hi", 3);
+    chan_close(5);
+    printf("%d %d %s %d\n", n, chan_recv(5, b, 8), b, chan_recv(5, b, 8));
+    return 0;
+}
+)";
+
+// 散列表、动态数组：扩容、删除后重新插入、不存在的键返回默认值
+static const char *source_map = R"(
+int main() {
+    int m, s, v, i, n, ok;
+    m = map_new(0);
+    i = 0;
+    while (i < 1000) {
+        map_put(m, i * 7, i);
+        i++;
+    }
+    ok = map_len(m) == 1000;
+    i = 0;
+    while (i < 1000) {
+        if (map_get(m, i * 7, -1) != i)
+            ok = 0;
+        i++;
+    }
+    i = 0;
+    n = 0;
+    while (i < 1000) {
+        n = n + map_del(m, i * 7);
+        i = i + 2;
+    }
+    printf("%d %d %d %d %d ", ok, n, map_len(m), map_get(m, 14, -1), map_get(m, 21, -1));
+    i = 0;
+    n = 0;
+    while (i < 1000) {
+        n = n + map_put(m, i * 7, -i);
+        i++;
+    }
+    printf("%d %d %d %d %d %d\n", n, map_len(m), map_get(m, 14, 0), map_get(m, 21, 0), map_get(m, 5, -9), map_del(m, 5));
+    s = map_new(1);
+    printf("%d %d ", map_put(s, "apple", 1), map_put(s, "pear", 2));
+    printf("%d %d %d ", map_put(s, "apple", 3), map_get(s, "apple", 0), map_get(s, "app", -1));
+    printf("%d %d %d %d ", map_del(s, "pear"), map_del(s, "pear"), map_put(s, "pear", 4), map_len(s));
+    printf("%d %d %d\n", map_free(s), map_free(s), map_free(m));
+    v = vec_new();
+    i = 0;
+    while (i < 500) {
+        if (vec_push(v, i * i) != i)
+            ok = 0;
+        i++;
+    }
+    vec_set(v, 499, -1);
+    printf("%d %d %d %d %d\n", ok, vec_len(v), vec_get(v, 0), vec_get(v, 300), vec_get(v, 499));
+    vec_free(v);
+    return 0;
+}
+)";
+
+static const char *expect_map = "1 500 500 -1 3 500 1000 -2 -3 -9 0\n"
+                                "1 1 0 3 -1 1 0 1 2 0 -1 0\n"
+                                "1 500 0 90000 -1\n"
+                                "exit(0)\n";
+
+// 排序与查找：qsort为稳定排序（只按十位比较），bsearch找不到时返回0
+static const char *source_sort = R"(
+int cmp(int *a, int *b) {
+    return *a / 10 - *b / 10;
+}
+int icmp(int *a, int *b) {
+    return *a - *b;
+}
+int main() {
+    int *a, *b, *k, i, n;
+    char *s;
+    a = malloc(40);
+    b = malloc(40);
+    k = malloc(4);
+    i = 0;
+    while (i < 10) {
+        a[i] = (i * 7 + 3) % 10 - 5;
+        b[i] = (9 - i) / 3 * 10 + i;
+        i++;
+    }
+    sort_int(a, 10);
+    i = 0;
+    while (i < 10) {
+        printf("%d ", a[i]);
+        i++;
+    }
+    *k = 4;
+    n = (int) bsearch(k, a, 10, 4, icmp) - (int) a;
+    *k = -5;
+    printf("%d %d ", n, (int) bsearch(k, a, 10, 4, icmp) - (int) a);
+    *k = 7;
+    printf("%d\n", bsearch(k, a, 10, 4, icmp));
+    s = malloc(8);
+    strcpy(s, "dcbazyx");
+    sort_bytes(s, 7);
+    n = qsort(b, 10, 4, cmp);
+    printf("%s %d", s, n > 0);
+    i = 0;
+    while (i < 10) {
+        printf(" %d", b[i]);
+        i++;
+    }
+    printf("\n");
+    return 0;
+}
+)";
+
+static const char *expect_sort = "-5 -4 -3 -2 -1 0 1 2 3 4 36 0 0\n"
+                                 "abcdxyz 1 7 8 9 14 15 16 21 22 23 30\n"
+                                 "exit(0)\n";
+
+// 字符串系统调用：长度超过一个向量宽度的字符串、找不到时返回0
+static const char *source_str = R"(
+int main() {
+    char *a, *l;
+    a = malloc(64);
+    l = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab";
+    printf("%s %d ", strcpy(a, "hello world"), strlen(a));
+    printf("%d %d %d %d %d %d ", strlen(""), strcmp(a, "hello world"), strcmp("abc", "abd") < 0,
+           strcmp("abd", "abc") > 0, strcmp("ab", "abc") < 0, strcmp(l, "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaac") < 0);
+    printf("%d %d %d %d %d\n", (int) strchr(a, 'w') - (int) a, strchr(a, 'z'), (int) strchr(l, 'b') - (int) l,
+           (int) memchr(a, 'o', 11) - (int) a, memchr(a, 'd', 10));
+    return 0;
+}
+)";
+
+// 分片运行：每次只执行少量指令，中途让出后继续
+static const char *source_budget = R"(
+int main() {
+    int i, s;
+    i = 0;
+    s = 0;
+    while (i < 100) {
+        s = s + i * i;
+        if (i % 25 == 0)
+            printf("%d %d\n", i, s);
+        i++;
+    }
+    return s % 256;
+}
+)";
+
+// 协程：yield按顺序轮转，join等待结束并取得返回值，已回收的协程返回-1
+static const char *source_task = R"(
+int step(int id) {
+    int i;
+    i = 0;
+    while (i < 3) {
+        printf("%c%d ", id, i);
+        yield();
+        i++;
+    }
+    return id;
+}
+int main() {
+    int a, b;
+    a = spawn(step, 'a');
+    b = spawn(step, 'b');
+    printf("m ");
+    yield();
+    printf("m ");
+    printf("%d %d %d\n", join(a), join(b), join(a));
+    return 0;
+}
+)";
+
+// 线程：atomic_add计数，atomic_cas实现的自旋锁保护普通变量，thread_join取得返回值，已回收的线程返回-1
+static const char *source_thread = R"(
+int total, lock, plain;
+int work(int n) {
+    int i;
+    i = 0;
+    while (i < n) {
+        atomic_add(&total, 1);
+        while (!atomic_cas(&lock, 0, 1)) {
+            yield();
+        }
+        plain = plain + 1;
+        lock = 0;
+        i++;
+    }
+    return n * 2;
+}
+int main() {
+    int *ids, i, r;
+    total = 0;
+    plain = 0;
+    ids = malloc(16);
+    i = 0;
+    while (i < 4) {
+        ids[i] = thread_create(work, 1000 * (i + 1));
+        i++;
+    }
+    r = 0;
+    i = 0;
+    while (i < 4) {
+        r = r + thread_join(ids[i]);
+        i++;
+    }
+    printf("%d %d %d %d %d\n", total, plain, r, atomic_add(&total, 5), thread_join(ids[0]));
+    return 0;
+}
+)";
+
+// parallel_for：每个i执行一次，嵌套调用返回-1，空区间返回0
+static const char *source_pfor = R"(
+int count, nested;
+int square(int i, int *arr) {
+    arr[i + 500] = i * i;
+    atomic_add(&count, 1);
+    if (i == 0)
+        nested = parallel_for(0, 2, square, arr);
+    return 0;
+}
+int main() {
+    int *arr, i, s, r;
+    arr = malloc(8000);
+    r = parallel_for(-500, 1500, square, arr);
+    s = 0;
+    i = 0;
+    while (i < 2000) {
+        if (arr[i] != (i - 500) * (i - 500))
+            s = s + 1;
+        i++;
+    }
+    printf("%d %d %d %d %d\n", r, count, s, nested, parallel_for(5, 5, square, arr));
+    return 0;
+}
+)";
+
+// fork：在等待fork_role()时复制虚拟机，父（1）子（2）各自写堆、数据段和散列表，用通道同步先后
+static const char *source_fork = R"(
+int g;
+int main() {
+    int *h, m, role;
+    char *d, *b;
+    h = malloc(16);
+    b = malloc(8);
+    d = "data";
+    h[0] = 1;
+    g = 1;
+    d[0] = 'D';
+    m = map_new(0);
+    map_put(m, 1, 1);
+    role = 0;
+    while (role == 0)
+        role = fork_role();
+    if (role == 1) {
+        h[0] = 10;
+        g = 10;
+        d[0] = 'P';
+        map_put(m, 1, 10);
+        chan_send(1, "p", 2);
+        chan_recv(2, b, 8);
+    } else {
+        chan_recv(1, b, 8);
+        h[0] = 20;
+        g = 20;
+        d[0] = 'C';
+        map_put(m, 1, 20);
+        chan_send(2, "c", 2);
+        chan_recv(3, b, 8);
+    }
+    printf("%d %d %d %s %d %s\n", role, h[0], g, d, map_get(m, 1, 0), b);
+    if (role == 1)
+        chan_send(3, "x", 2);
+    return role;
+}
+)";
+
+static std::atomic<int> fork_role{0};
+
+// 快照：有散列表时checkpoint返回-1；保存后继续运行返回0，恢复后从checkpoint处返回1
+static const char *source_ckpt = R"(
+int g;
+int main() {
+    int *h, m, r;
+    h = malloc(8);
+    h[0] = 7;
+    g = 5;
+    m = map_new(0);
+    printf("%d ", checkpoint("test_vm.snap"));
+    map_free(m);
+    r = checkpoint("test_vm.snap");
+    printf("%d %d %d\n", r, h[0], g);
+    h[0] = 8;
+    g = 6;
+    return r;
+}
+)";
+
+// 大文件：超过4GB的稀疏文件，seek、pread使用64位位置
+static const char *source_big = R"(
+int main() {
+    int fd, *pos;
+    char *buf;
+    pos = malloc(8);
+    buf = malloc(8);
+    fd = open("test_vm.big", 2 | 0x40 | 0x200);
+    pos[0] = 1073741824;
+    pos[1] = 1;
+    printf("%d ", seek(fd, pos, 0));
+    write(fd, "tail", 4);
+    pos[0] = 0;
+    pos[1] = 0;
+    seek(fd, pos, 2);
+    printf("%lld ", pos[0], pos[1]);
+    printf("%d ", pread(fd, buf, 4, 1073741824, 1));
+    buf[4] = 0;
+    printf("%s ", buf);
+    pos[0] = -2;
+    pos[1] = -1;
+    seek(fd, pos, 1);
+    printf("%lld %d %d\n", pos[0], pos[1], read(fd, buf, 8), pread(fd, buf, 4, -1, -1));
+    close(fd);
+    return 0;
+}
+)";
+
+// 文件句柄：不创建时打开失败，截断、追加、读写方式打开，read到末尾返回0，pread不改变当前位置，写句柄1即输出
+static const char *source_file = R"(
+int main() {
+    int fd, n, *pos;
+    char *buf;
+    pos = malloc(8);
+    buf = malloc(32);
+    printf("%d ", open("test_vm.none", 1));
+    fd = open("test_vm.txt", 1 | 0x40 | 0x200);
+    printf("%d ", write(fd, "hello ", 6) + write(fd, "world", 5));
+    close(fd);
+    fd = open("test_vm.txt", 1 | 0x400);
+    write(fd, "!", 1);
+    close(fd);
+    fd = open("test_vm.txt", 2);
+    write(fd, "J", 1);
+    pos[0] = 0;
+    pos[1] = 0;
+    seek(fd, pos, 0);
+    n = read(fd, buf, 32);
+    buf[n] = 0;
+    printf("%d %s %d ", n, buf, read(fd, buf, 32));
+    pos[0] = 6;
+    seek(fd, pos, 0);
+    n = read(fd, buf, 5);
+    buf[n] = 0;
+    printf("%s ", buf);
+    n = pread(fd, buf, 4, 1, 0);
+    buf[n] = 0;
+    printf("%d %s ", n, buf);
+    n = read(fd, buf, 1);
+    buf[n] = 0;
+    printf("%s %d %d\n", buf, close(fd), close(fd));
+    write(1, "out\n", 4);
+    return 0;
+}
+)";
+
+// 文件映射：文件之后为'\0'，文件不存在时返回0，映射区用完后返回0
+static const char *source_mmap = R"(
+int main() {
+    char *p, *q, *last;
+    int n;
+    p = mmap_file("test_vm.map");
+    printf("%s %d %d ", p, p[5], mmap_file("test_vm.none"));
+    n = 1;
+    last = p;
+    q = mmap_file("test_vm.map");
+    while (q) {
+        n++;
+        last = q;
+        q = mmap_file("test_vm.map");
+    }
+    printf("%d %x %s\n", n, last, last);
+    return 0;
+}
+)";
+
+// 写入映射的文件时报错
+static const char *source_mmap_write = R"(
+int main() {
+    char *p;
+    p = mmap_file("test_vm.map");
+    p[0] = 'j';
+    printf("%s\n", p);
+    return 0;
+}
+)";
+
+// 异步读写：await等待时切换到其他协程，句柄或请求号无效时为-1，awrite句柄1即输出
+static const char *source_aio = R"(
+int reader(int fd) {
+    char *buf;
+    int n;
+    buf = malloc(16);
+    n = await(aread(fd, buf, 16));
+    buf[n] = 0;
+    printf("r%d %s ", n, buf);
+    return n;
+}
+int main() {
+    int fd, t, *pos;
+    pos = malloc(8);
+    fd = open("test_vm.aio", 2 | 0x40 | 0x200);
+    printf("%d ", await(awrite(fd, "async data", 10)));
+    pos[0] = 0;
+    pos[1] = 0;
+    seek(fd, pos, 0);
+    t = spawn(reader, fd);
+    printf("%d ", join(t));
+    printf("%d %d ", await(aread(99, pos, 4)), await(12345));
+    t = awrite(1, "to output ", 10);
+    printf("%d\n", await(t));
+    close(fd);
+    return 0;
+}
+)";
+
+static std::string expect(int n) {
+    char buf[64];
+    auto m = n * 100;
+    snprintf(buf, sizeof(buf), "argc=2 n=%d sum=%d twice=%d %s\nexit(%d)\n", n, m * (m + 1) / 2, n * 2,
+             std::string("abababab", (uint) n * 2).c_str(), n);
+    return buf;
+}
+
+// 单线程运行脚本，比较输出
+static bool check(const char *name, const std::string &src, const std::string &required) {
+    std::string out;
+    cprogram::compile(src)->run({"test"}, [&](const char *buf, uint len) {
+        out.append(buf, len);
+    });
+    printf("[TEST] %s: %s", name, out.c_str());
+    if (out != required) {
+        printf("ERROR! REQUIRED: %s", required.c_str());
+        return false;
+    }
+    return true;
+}
+
+// 以budget条指令为一片运行至结束，输出、退出码、指令数应与一次运行至结束相同
+static bool check_budget(const char *name, const std::string &src, int budget) {
+    auto prog = cprogram::compile(src);
+    std::string full, part;
+    auto vm = prog->instantiate({"test"}, [&](const char *buf, uint len) { full.append(buf, len); });
+    vm->exec();
+    auto slices = 0;
+    auto sliced = prog->instantiate({"test"}, [&](const char *buf, uint len) { part.append(buf, len); });
+    while (sliced->exec(budget) != vm_exit) {
+        slices++;
+    }
+    printf("[TEST] %s: %d slices, %llu cycles\n", name, slices, (unsigned long long) sliced->get_cycle());
+    if (slices < 2 || part != full || sliced->get_exit_code() != vm->get_exit_code() ||
+        sliced->get_cycle() != vm->get_cycle()) {
+        printf("ERROR! REQUIRED: %llu cycles\n%s", (unsigned long long) vm->get_cycle(), full.c_str());
+        return false;
+    }
+    return true;
+}
+
+// 同一虚拟机多次init后运行，每次的输出都应相同
+static bool check_rerun(const char *name, const std::string &src, const std::string &required, int times) {
+    auto prog = cprogram::compile(src);
+    auto vm = prog->create();
+    for (auto i = 0; i < times; i++) {
+        std::string out;
+        prog->start(*vm, {"test"}, [&](const char *buf, uint len) { out.append(buf, len); });
+        vm->exec();
+        printf("[TEST] %s %d: %s", name, i, out.c_str());
+        if (out != required) {
+            printf("ERROR! REQUIRED: %s", required.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// 线程池：区间宽于INT_MAX时，各块首尾相接，恰好覆盖整个区间
+static bool check_pool(const char *name, int lo, int hi) {
+    cpool pool(4);
+    std::mutex lock;
+    std::vector<std::pair<int, int>> chunks;
+    pool.run(lo, hi, [&](int, int l, int h) {
+        std::lock_guard<std::mutex> guard(lock);
+        chunks.emplace_back(l, h);
+    });
+    std::sort(chunks.begin(), chunks.end());
+    auto next = lo;
+    auto ok = true;
+    for (auto &c : chunks) {
+        if (c.first != next || c.second <= c.first)
+            ok = false;
+        next = c.second;
+    }
+    ok = ok && next == hi;
+    printf("[TEST] %s: %d chunks%s\n", name, (int) chunks.size(), ok ? "" : ", ERROR! NOT A PARTITION");
+    return ok;
+}
+
+// 通道：填充消息时抛出异常，槽仍被发布并在接收时跳过，之后的消息照常收发
+static bool check_chan_fail(const char *name) {
+    cchan chan(4);
+    std::string out;
+    auto recv = [&](const byte *src, uint32_t len) { out.append((const char *) src, len); out += ' '; };
+    for (auto i = 0; i < 6; i++) { // 超过容量，槽被循环使用
+        try {
+            chan.try_send(3, [](byte *) { throw std::exception(); });
+            out += "sent ";
+        } catch (const std::exception &) {
+            out += "fail ";
+        }
+        out += chan.try_recv(recv) ? "" : "empty ";
+        auto msg = std::to_string(i);
+        chan.try_send((uint32_t) msg.size(), [&](byte *dst) { memcpy(dst, msg.data(), msg.size()); });
+        chan.try_recv(recv);
+    }
+    printf("[TEST] %s: %s\n", name, out.c_str());
+    if (out != "fail empty 0 fail empty 1 fail empty 2 fail empty 3 fail empty 4 fail empty 5 ") {
+        printf("ERROR!\n");
+        return false;
+    }
+    return true;
+}
+
+// 父虚拟机写入后子虚拟机写入，父虚拟机先结束并析构，子虚拟机仍能读到fork前共享的页面
+static bool check_fork(const char *name, const std::string &src) {
+    auto prog = cprogram::compile(src);
+    std::string pout, cout;
+    fork_role = 0;
+    auto parent = prog->instantiate({"test"}, [&](const char *buf, uint len) { pout.append(buf, len); });
+    parent->exec(20000); // 停在等待fork_role()的循环中
+    auto child = parent->fork();
+    child->set_output([&](const char *buf, uint len) { cout.append(buf, len); });
+    fork_role = 1;
+    parent->exec(20000); // 写入后等待子虚拟机
+    fork_role = 2;
+    child->exec(20000); // 写入后等待父虚拟机结束
+    parent->exec();
+    auto pcode = parent->get_exit_code();
+    parent.reset();
+    child->exec();
+    printf("[TEST] %s: %s%s", name, pout.c_str(), cout.c_str());
+    if (pout != "1 10 10 Pata 10 c\nexit(1)\n" || cout != "2 20 20 Cata 20 x\nexit(2)\n" ||
+        pcode != 1 || child->get_exit_code() != 2) {
+        printf("ERROR! REQUIRED: 1 10 10 Pata 10 c\nexit(1)\n2 20 20 Cata 20 x\nexit(2)\n");
+        return false;
+    }
+    return true;
+}
+
+// 运行至checkpoint保存快照，再从快照恢复运行，恢复后的页面、寄存器应为保存时的
+static bool check_restore(const char *name, const std::string &src, const char *path) {
+    std::string out, rout;
+    cprogram::compile(src)->run({"test"}, [&](const char *buf, uint len) { out.append(buf, len); });
+    auto vm = cvm::restore(path);
+    vm->set_output([&](const char *buf, uint len) { rout.append(buf, len); });
+    vm->exec();
+    remove(path);
+    printf("[TEST] %s: %s%s", name, out.c_str(), rout.c_str());
+    if (out != "-1 0 7 5\nexit(0)\n" || rout != "1 7 5\nexit(1)\n") {
+        printf("ERROR! REQUIRED: -1 0 7 5\nexit(0)\n1 7 5\nexit(1)\n");
+        return false;
+    }
+    return true;
+}
+
+static std::string read_file(const char *path) {
+    std::string s;
+    auto f = fopen(path, "rb");
+    if (f) {
+        char buf[4096];
+        uint n;
+        while ((n = (uint) fread(buf, 1, sizeof(buf), f)) > 0)
+            s.append(buf, n);
+        fclose(f);
+    }
+    return s;
+}
+
+static void write_file(const char *path, const std::string &s) {
+    auto f = fopen(path, "wb");
+    if (f) {
+        fwrite(s.data(), 1, s.size(), f);
+        fclose(f);
+    }
+}
+
+// 载入改动过的镜像，应报错
+static bool load_fails(const char *path, const std::string &img) {
+    write_file(path, img);
+    try {
+        cprogram::load(path);
+    } catch (const std::exception &) {
+        return true;
+    }
+    return false;
+}
+
+// 镜像：保存后载入运行，输出与直接运行相同；系统调用名不符、文件头中的页数回绕、入口越界时拒绝载入
+static bool check_image(const char *name, const std::string &src, const char *sys, const char *path) {
+    std::string out, iout;
+    auto prog = cprogram::compile(src);
+    prog->run({"test"}, [&](const char *buf, uint len) { out.append(buf, len); });
+    auto ok = prog->image().save(path);
+    ok = ok && cprogram::load(path)->run({"test"}, [&](const char *buf, uint len) { iout.append(buf, len); }) == 0;
+    ok = ok && iout == out;
+    auto img = read_file(path);
+    auto mismatch = img;
+    auto at = mismatch.find(std::string(1, '\0') + sys + '\0');
+    ok = ok && at != std::string::npos && at + 2 < img.size();
+    if (ok) {
+        mismatch[at + 2] ^= 1; // 改动名称中的一个字符
+        ok = load_fails(path, mismatch);
+    }
+    if (ok) {
+        auto wrap = img;
+        uint32_t pages = 0x100000; // pages * PAGE_SIZE在32位下为0
+        memcpy(&wrap[32], &pages, sizeof(pages));
+        ok = load_fails(path, wrap);
+    }
+    if (ok) {
+        auto entry = img;
+        int pc = 0x7fffffff;
+        memcpy(&entry[8], &pc, sizeof(pc));
+        ok = load_fails(path, entry);
+    }
+    remove(path);
+    printf("[TEST] %s: %s", name, iout.c_str());
+    if (!ok) {
+        printf("ERROR! REQUIRED: %s", out.c_str());
+        return false;
+    }
+    return true;
+}
+
+// 编译缓存：未命中、写入后命中并可运行；镜像版本不符时当作未命中；系统调用表变化后使用新的键
+static bool check_cache(const char *name, const std::string &src, const char *dir) {
+    ccache cache(dir);
+    auto hits = cache.hits(), misses = cache.misses();
+    auto prog = cprogram::compile(src);
+    std::string out;
+    auto ok = !cache.get(src) && cache.put(src, prog->image());
+    auto img = cache.get(src);
+    if (ok && img) {
+        cvm vm(img->code, img->data);
+        vm.set_output([&](const char *buf, uint len) { out.append(buf, len); });
+        char arg[] = "test", *args[] = {arg};
+        vm.init(img->entry, 1, args);
+        vm.exec();
+    } else {
+        ok = false;
+    }
+    auto file = cache.path(src);
+    auto stale = read_file(file.c_str());
+    ok = ok && stale.size() > 8;
+    if (ok) {
+        stale[4]++; // 文件头中的版本
+        write_file(file.c_str(), stale);
+        ok = !cache.get(src) && cache.put(src, prog->image()) && cache.get(src);
+    }
+    cvm::add_syscall("cache_probe", 0, [](cvm_call &) { return 0; });
+    ok = ok && cache.path(src) != file && !cache.get(src);
+    ok = ok && cache.hits() - hits == 2 && cache.misses() - misses == 3;
+    remove(file.c_str());
+    remove((std::string(dir) + "/hits").c_str());
+    remove((std::string(dir) + "/misses").c_str());
+    remove(dir);
+    printf("[TEST] %s: %s", name, out.c_str());
+    if (!ok || out != "hello world 11 0 0 1 1 1 1 6 0 45 4 0\nexit(0)\n") {
+        printf("ERROR! REQUIRED: hello world 11 0 0 1 1 1 1 6 0 45 4 0\nexit(0)\n");
+        return false;
+    }
+    return true;
+}
+
+// 运行时应报错
+static bool check_throws(const char *name, const std::string &src) {
+    std::string out;
+    try {
+        cprogram::compile(src)->run({"test"}, [&](const char *buf, uint len) { out.append(buf, len); });
+    } catch (const std::exception &) {
+        printf("[TEST] %s: thrown\n", name);
+        return true;
+    }
+    printf("[TEST] %s: %sERROR! REQUIRED: exception\n", name, out.c_str());
+    return false;
+}
+
+// 分片运行，协程都在等待异步读写时exec提前返回，由宿主wait
+static bool check_sliced(const char *name, const std::string &src, const std::string &required, int budget) {
+    std::string out;
+    auto vm = cprogram::compile(src)->instantiate({"test"}, [&](const char *buf, uint len) { out.append(buf, len); });
+    while (vm->exec(budget) != vm_exit) {
+        vm->wait();
+    }
+    printf("[TEST] %s: %s", name, out.c_str());
+    if (out != required) {
+        printf("ERROR! REQUIRED: %s", required.c_str());
+        return false;
+    }
+    return true;
+}
+
+// code/中的示例脚本都能编译；多为压测，输出含耗时，只编译不运行
+static bool check_demos(const std::string &dir) {
+    static const char *demos[] = {
+        "aio.txt",
+        "bench_ckpt.txt",
+        "bench_map.txt",
+        "bench_pfor.txt",
+        "bench_print.txt",
+        "bench_psum.txt",
+        "bench_sort.txt",
+        "bench_str.txt",
+        "bench_write.txt",
+        "bench_yield.txt",
+        "grep.txt",
+        "pipe_gen.txt",
+        "pipe_print.txt",
+        "pipe_upper.txt",
+        "test.txt",
+        "wc.txt",
+        "xc.txt"
+    };
+    auto ok = true;
+    for (auto demo : demos) {
+        auto src = read_file((dir + "/" + demo).c_str());
+        try {
+            if (src.empty())
+                throw std::exception();
+            cprogram::compile(src);
+            printf("[TEST] demo %s: compiled\n", demo);
+        } catch (const std::exception &) {
+            printf("[TEST] demo %s: ERROR! CANNOT COMPILE\n", demo);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    cvm::add_syscall("twice", 1, [](cvm_call &c) { return (int) c.arg(0) * 2; }); // 宿主函数
+    add_native("repeat", [](std::string s, int n) { // 按签名转换参数和返回值
+        std::string r;
+        while (n-- > 0)
+            r += s;
+        return r;
+    });
+    add_native("clen", [](const char *s) { return (int) strlen(s); });
+    add_native("cecho", [](const char *s) { return std::string(s); });
+    add_native("fork_role", []() { return fork_role.load(); });
+    auto prog = cprogram::compile(source);
+    std::vector<std::string> outs(TEST_THREADS);
+    std::vector<int> codes(TEST_THREADS);
+    std::vector<std::thread> ths;
+    for (auto i = 0; i < TEST_THREADS; i++) {
+        ths.emplace_back([&, i]() {
+            auto &out = outs[i];
+            codes[i] = prog->run({"test", std::to_string(i + 1)}, [&](const char *buf, uint len) {
+                out.append(buf, len);
+            });
+        });
+    }
+    for (auto &th : ths) {
+        th.join();
+    }
+    for (auto i = 0; i < TEST_THREADS; i++) {
+        printf("[TEST] vm %d: %s", i, outs[i].c_str());
+        if (outs[i] != expect(i + 1) || codes[i] != i + 1) {
+            printf("ERROR! REQUIRED: %s", expect(i + 1).c_str());
+            exit(-1);
+        }
+    }
+    if (!check("page", source_page("%d %s\\n", "clen(p), cecho(p)"), "8 abcdefgh\nexit(0)\n"))
+        exit(-1);
+    if (!check("printf", source_printf, expect_printf))
+        exit(-1);
+    if (!check("printf page", source_page("[%s|%.5s|%10s|%-10s]\\n", "p, p, p, p"),
+               "[abcdefgh|abcde|  abcdefgh|abcdefgh  ]\nexit(0)\n"))
+        exit(-1);
+    if (!check("shadow", source_shadow, "42 3 1\nexit(0)\n"))
+        exit(-1);
+    for (auto i = 0; i < 2; i++) {
+        if (!check("chan", source_chan, "3 3 hi -1\nexit(0)\n"))
+            exit(-1);
+    }
+    if (!check("map", source_map, expect_map))
+        exit(-1);
+    if (!check("sort", source_sort, expect_sort))
+        exit(-1);
+    if (!check("str", source_str, "hello world 11 0 0 1 1 1 1 6 0 45 4 0\nexit(0)\n"))
+        exit(-1);
+    if (!check("str page", source_page("%d %d %d %d %d\\n", "strlen(p), (int) strchr(p, 'f') - (int) p, "
+                                      "strcmp(p, strcpy(malloc(16), p)), strlen(strcpy(malloc(16), p)), "
+                                      "(int) memchr(p, 'h', 8) - (int) p"),
+               "8 5 0 8 7\nexit(0)\n"))
+        exit(-1);
+    if (!check_budget("budget", source_budget, 37))
+        exit(-1);
+    if (!check("task", source_task, "m a0 b0 m a1 b1 a2 b2 97 98 -1\nexit(0)\n"))
+        exit(-1);
+    if (!check_rerun("thread", source_thread, "10000 10000 20000 10000 -1\nexit(0)\n", 3))
+        exit(-1);
+    if (!check("pfor", source_pfor, "0 2000 0 -1 0\nexit(0)\n"))
+        exit(-1);
+    if (!check_pool("pool", INT_MIN, INT_MAX))
+        exit(-1);
+    if (!check_chan_fail("chan fail"))
+        exit(-1);
+    if (!check_fork("fork", source_fork))
+        exit(-1);
+    if (!check_restore("restore", source_ckpt, "test_vm.snap"))
+        exit(-1);
+    if (!check_image("image", source_str, "strchr", "test_vm.img"))
+        exit(-1);
+    if (!check_cache("cache", source_str, "test_vm.cache"))
+        exit(-1);
+    auto big = check("big file", source_big, "0 5368709124 4 tail 5368709122 2 -1\nexit(0)\n");
+    remove("test_vm.big");
+    if (!big)
+        exit(-1);
+    auto file = check("file", source_file, "-1 11 12 Jello world! 0 world 4 ello ! 0 -1\nout\nexit(0)\n");
+    remove("test_vm.txt");
+    if (!file)
+        exit(-1);
+    write_file("test_vm.map", "hello");
+    auto mmap = check("mmap", source_mmap, "hello 0 0 30719 ffffc000 hello\nexit(0)\n") &&
+                check_throws("mmap write", source_mmap_write);
+    remove("test_vm.map");
+    if (!mmap)
+        exit(-1);
+    auto aio = check("aio", source_aio, "10 r10 async data 10 -1 -1 to output 10\nexit(0)\n") &&
+               check_sliced("aio sliced", source_aio, "10 r10 async data 10 -1 -1 to output 10\nexit(0)\n", 50);
+    remove("test_vm.aio");
+    if (!aio)
+        exit(-1);
+    if (argc > 1 && !check_demos(argv[1])) // 参数为code目录
+        exit(-1);
+    printf("ALL PASS");
+    return 0;
+}